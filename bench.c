@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include "mtelib.h"
+#include "mtelib_mode.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef PROT_MTE
+	#define PROT_MTE (0x20)
+#endif
+
+//Name of the configuration this benchmark was built with, as chosen by bench.sh
+#ifndef BENCH_CONFIG
+	#define BENCH_CONFIG "custom"
+#endif
+
+#define MIN_SIZE        (16ULL)
+#define DEFAULT_MAX_SIZE (1ULL << 30)
+#define BYTES_PER_RUN   (256ULL << 20) //Bytes processed by each measurement, at least
+#define MIN_REPS        (3ULL)
+#define WARMUP_REPS     (2ULL)
+#define RANDOM_TAG_REPS (1ULL << 20)
+#define DEFAULT_REPETITIONS (5)  //Measurements per point, the median one being reported
+#define MAX_REPETITIONS (31)
+
+typedef struct BenchOp {
+	const char* name;
+	void (*fn)(void* dst, const void* src, size_t size);
+} BenchOp;
+
+static void benchMemoryTag(void* dst, const void* src, size_t size) { (void)src; memoryTag(dst, size); }
+static void benchMemoryTagAndZero(void* dst, const void* src, size_t size) { (void)src; memoryTagAndZero(dst, size); }
+static void benchMemoryTagAndZeroStreaming(void* dst, const void* src, size_t size) { (void)src; memoryTagAndZeroStreaming(dst, size); }
+static void benchMemoryTagAndCopy(void* dst, const void* src, size_t size) { memoryTagAndCopy(dst, src, size); }
+static void benchMemset(void* dst, const void* src, size_t size) { (void)src; memset(dst, 0, size); }
+static void benchMemcpy(void* dst, const void* src, size_t size) { memcpy(dst, src, size); }
+
+static const BenchOp ops[] = {
+	{ "memoryTag",                 benchMemoryTag },
+	{ "memoryTagAndZero",          benchMemoryTagAndZero },
+	{ "memoryTagAndZeroStreaming", benchMemoryTagAndZeroStreaming },
+	{ "memoryTagAndCopy",          benchMemoryTagAndCopy },
+	{ "memset",                    benchMemset },
+	{ "memcpy",                    benchMemcpy },
+};
+
+//Offsets from a 64-byte boundary the destination is placed at
+static const size_t offsets[] = { 0, GRANULE_SIZE };
+
+static int cyclesFd = -1;
+static int csv = 0; //Results are printed as CSV rows (-C), missing values being left empty
+static int repetitions = DEFAULT_REPETITIONS;
+
+typedef struct Sample {
+	uint64_t ns;
+	uint64_t cycles;
+} Sample;
+
+static void openCycleCounter(void) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cyclesFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (cyclesFd < 0) {
+		fprintf(stderr, "Cycle counter unavailable (%s), cycles/byte won't be reported.\n", strerror(errno));
+	}
+}
+
+static uint64_t readCycles(void) {
+	uint64_t cycles = 0;
+	if (cyclesFd < 0 || read(cyclesFd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+		return 0;
+	}
+	return cycles;
+}
+
+static uint64_t readNanoseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compareSamples(const void* a, const void* b) {
+	const uint64_t x = ((const Sample*)a)->ns;
+	const uint64_t y = ((const Sample*)b)->ns;
+	return (x > y) - (x < y);
+}
+
+//Sorts samples by time and returns the median one. *noise receives the interquartile range of the samples, in percent of the median.
+static Sample medianSample(Sample* samples, int count, double* noise) {
+	qsort(samples, (size_t)count, sizeof(Sample), compareSamples);
+	const Sample median = samples[count / 2];
+	const uint64_t range = samples[(3 * count) / 4].ns - samples[count / 4].ns;
+	*noise = (median.ns != 0) ? (double)range * 100.0 / (double)median.ns : 0.0;
+	return median;
+}
+
+static void report(const char* op, size_t size, size_t offset, uint64_t reps, Sample sample, double noise) {
+	const double bytes = (double)size * (double)reps;
+	const double ns = (double)sample.ns;
+	if (csv) {
+		printf("%s,%s,%zu,%zu,%.2f,%.3f,", BENCH_CONFIG, op, size, offset, ns / (double)reps, bytes / ns);
+		if (sample.cycles != 0) {
+			printf("%.4f", (double)sample.cycles / bytes);
+		}
+		printf(",%.2f\n", noise);
+		return;
+	}
+	printf("%-12s %-26s %12zu %6zu %12.2f %10.3f ", BENCH_CONFIG, op, size, offset, ns / (double)reps, bytes / ns);
+	if (sample.cycles != 0) {
+		printf("%10.4f %7.2f\n", (double)sample.cycles / bytes, noise);
+	} else {
+		printf("%10s %7.2f\n", "-", noise);
+	}
+}
+
+static void runOp(const BenchOp* op, char* dst, const char* src, size_t size, size_t offset) {
+	uint64_t reps = BYTES_PER_RUN / size;
+	if (reps < MIN_REPS) {
+		reps = MIN_REPS;
+	}
+
+	for (uint64_t i = 0; i < WARMUP_REPS; i++) {
+		op->fn(dst + offset, src, size);
+	}
+
+	Sample samples[MAX_REPETITIONS];
+	for (int r = 0; r < repetitions; r++) {
+		const uint64_t startCycles = readCycles();
+		const uint64_t startNs = readNanoseconds();
+		for (uint64_t i = 0; i < reps; i++) {
+			op->fn(dst + offset, src, size);
+		}
+		samples[r].ns = readNanoseconds() - startNs;
+		samples[r].cycles = (cyclesFd < 0) ? 0 : readCycles() - startCycles;
+	}
+
+	double noise;
+	const Sample median = medianSample(samples, repetitions, &noise);
+	report(op->name, size, offset, reps, median, noise);
+}
+
+static TagGenerator generator;
+
+static void* benchPointerSetRandomTag(void* ptr, ExcludeMask excluded) { return pointerSetRandomTag(ptr, excluded); }
+static void* benchTagGeneratorSetTag(void* ptr, ExcludeMask excluded) { return tagGeneratorSetTag(&generator, ptr, excluded); }
+
+static void runRandomTag(const char* name, void* (*fn)(void* ptr, ExcludeMask excluded), char* ptr) {
+	void* volatile sink;
+	void* tagged = ptr;
+
+	for (uint64_t i = 0; i < RANDOM_TAG_REPS / 16; i++) {
+		tagged = fn(tagged, excludeMaskAddPtrTag(0, tagged));
+	}
+
+	Sample samples[MAX_REPETITIONS];
+	for (int r = 0; r < repetitions; r++) {
+		const uint64_t startCycles = readCycles();
+		const uint64_t startNs = readNanoseconds();
+		for (uint64_t i = 0; i < RANDOM_TAG_REPS; i++) {
+			//Exclude the previous tag to include the exclude mask setup, as done by allocators
+			tagged = fn(tagged, excludeMaskAddPtrTag(0, tagged));
+		}
+		samples[r].ns = readNanoseconds() - startNs;
+		samples[r].cycles = readCycles() - startCycles;
+	}
+	sink = tagged;
+	(void)sink;
+
+	double noise;
+	const Sample median = medianSample(samples, repetitions, &noise);
+	if (csv) {
+		printf("%s,%s,,,%.2f,,", BENCH_CONFIG, name, (double)median.ns / RANDOM_TAG_REPS);
+		if (cyclesFd >= 0) {
+			printf("%.4f", (double)median.cycles / RANDOM_TAG_REPS);
+		}
+		printf(",%.2f\n", noise);
+		return;
+	}
+	printf("%-12s %-26s %12s %6s %12.2f %10s ", BENCH_CONFIG, name, "-", "-", (double)median.ns / RANDOM_TAG_REPS, "-");
+	if (cyclesFd >= 0) {
+		printf("%10.4f %7.2f\n", (double)median.cycles / RANDOM_TAG_REPS, noise);
+	} else {
+		printf("%10s %7.2f\n", "-", noise);
+	}
+}
+
+static void usage(const char* argv0) {
+	printf("Usage: %s [-c cpu] [-m max_size] [-r repetitions] [-C] [-H]\n", argv0);
+	printf("  -c cpu       Pin the benchmark to this CPU (default: 0)\n");
+	printf("  -m max_size  Largest size benchmarked, in bytes (default: %llu)\n", DEFAULT_MAX_SIZE);
+	printf("  -r reps      Measurements per point, the median one is reported (default: %d, at most %d)\n", DEFAULT_REPETITIONS, MAX_REPETITIONS);
+	printf("  -C           Print results as CSV\n");
+	printf("  -H           Don't print the header line\n");
+}
+
+int main(int argc, char** argv) {
+	int cpu = 0;
+	size_t maxSize = DEFAULT_MAX_SIZE;
+	int header = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:m:r:CHh")) != -1) {
+		switch (opt) {
+		case 'c': cpu = atoi(optarg); break;
+		case 'm': maxSize = strtoull(optarg, NULL, 0); break;
+		case 'r': repetitions = atoi(optarg); break;
+		case 'C': csv = 1; break;
+		case 'H': header = 0; break;
+		default: usage(argv[0]); return (opt == 'h') ? 0 : 1;
+		}
+	}
+	maxSize &= ~(size_t)GRANULE_ALIGNMENT_MASK;
+	if (repetitions < 1 || repetitions > MAX_REPETITIONS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	//Same setup as test.c: tag checks enabled, synchronous faults
+	if (mteModeSet(MTE_MODE_SYNC, excludeMaskAddTag(0, MAX_TAG)) < 0) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	//Destination gets one extra block for the misaligned runs.
+	const size_t mapSize = maxSize + 64;
+	char* dst = mmap(NULL, mapSize, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	char* src = mmap(NULL, mapSize, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (dst == MAP_FAILED || src == MAP_FAILED) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	//Tag the destination once, so that the baselines go through tag checks too.
+	dst = pointerSetRandomTag(dst, 0);
+	memoryTag(dst, mapSize);
+	memset(src, 0x5A, mapSize);
+
+	openCycleCounter();
+	if (csv && header) {
+		puts("config,op,size,offset,ns_per_op,gb_per_s,cycles_per_byte,noise_pct");
+	} else if (header) {
+		printf("%-12s %-26s %12s %6s %12s %10s %10s %7s\n", "config", "op", "size", "offset", "ns/op", "GB/s", "cycles/B", "noise%");
+	}
+
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		for (size_t size = MIN_SIZE; size <= maxSize; size <<= 1) {
+			for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+				runOp(&ops[i], dst, src, size, offsets[j]);
+			}
+		}
+	}
+	runRandomTag("pointerSetRandomTag", benchPointerSetRandomTag, dst);
+	tagGeneratorSeed(&generator, 1);
+	runRandomTag("tagGeneratorSetTag", benchTagGeneratorSetTag, dst);
+
+	munmap(pointerSetTag(dst, 0), mapSize);
+	munmap(src, mapSize);
+	return 0;
+}
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Builds bench.c once per valid combination of MTELIB_* defines, runs each build and collects all results in a CSV file.
+# Each point is measured several times by bench.c (-r, default: 5), which reports the median measurement and the noise of
+# the point (interquartile range of the measurements, in percent of the median).
+# When given a baseline (the CSV file of a previous run), results whose throughput dropped by more than both the threshold
+# and the noise of the point (in the baseline and in this run, added up) are reported, and the script exits with status 2.
+#
+# Usage: ./bench.sh [-o results.csv] [-b baseline.csv] [-t threshold_percent] [-k] [-- benchmark arguments]
+#   -o  Where results are written (default: bench-results.csv)
+#   -b  Results of a previous run to compare against
+#   -t  Smallest throughput drop reported, in percent (default: 5), raised to the noise of points noisier than that
+#   -k  Only build the configurations, without running them
+# e.g. ./bench.sh -o new.csv -b old.csv -- -c 2 -m 67108864
+CC=${CC:-clang}
+CFLAGS=${CFLAGS:-"-O2 -march=armv8.5-a+memtag -Wall"}
+BUILD_DIR=${BUILD_DIR:-bench-build}
+
+results=bench-results.csv
+baseline=
+threshold=5
+buildOnly=0
+while getopts "o:b:t:k" opt; do
+	case $opt in
+	o) results=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	k) buildOnly=1 ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+# Prints "name:defines" for every valid configuration.
+# MTELIB_NO_INTRINSICS and MTELIB_NO_INLINE_ASSEMBLY can't be combined, nor can both alignment check defines.
+# Options only effective with inline assembly aren't combined with MTELIB_NO_INLINE_ASSEMBLY, as they would build the same code.
+configs() {
+	for align in ":" "relaxed-align:-DMTELIB_RELAXED_ALIGNMENT_CHECKS" "no-align:-DMTELIB_NO_ALIGNMENT_CHECKS"; do
+		for base in "default:" "no-intrinsics:-DMTELIB_NO_INTRINSICS"; do
+			for dgranule in ":" "no-dgranule:-DMTELIB_DISABLE_DGRANULE_OPERATIONS"; do
+				for dcgva in ":" "no-dc-gva:-DMTELIB_DISABLE_DC_GVA"; do
+					for small in ":" "no-small-path:-DMTELIB_DISABLE_SMALL_SIZE_PATH"; do
+						echo "$base $dgranule $dcgva $small $align"
+					done
+				done
+			done
+		done
+		echo "no-asm:-DMTELIB_NO_INLINE_ASSEMBLY $align"
+	done | while read -r parts; do
+		name=
+		defines=
+		for part in $parts; do
+			[ -n "${part%%:*}" ] && name="$name${name:+-}${part%%:*}"
+			[ -n "${part#*:}" ] && defines="$defines ${part#*:}"
+		done
+		echo "$name:$defines"
+	done
+}
+
+mkdir -p "$BUILD_DIR" || exit 1
+echo "config,op,size,offset,ns_per_op,gb_per_s,cycles_per_byte,noise_pct" > "$results" || exit 1
+for config in $(configs | tr ' ' '@'); do
+	name=${config%%:*}
+	defines=$(echo "${config#*:}" | tr '@' ' ')
+	echo "== $name ==" >&2
+	$CC $CFLAGS $defines -DBENCH_CONFIG=\"$name\" -o "$BUILD_DIR/bench-$name" bench.c || exit 1
+	if [ $buildOnly -eq 0 ]; then
+		"$BUILD_DIR/bench-$name" -C -H "$@" >> "$results" || exit 1
+	fi
+done
+
+if [ -z "$baseline" ] || [ $buildOnly -ne 0 ]; then
+	exit 0
+fi
+
+# Compares GB/s where available, ns per call otherwise (pointerSetRandomTag, tagGeneratorSetTag).
+awk -F, -v threshold="$threshold" '
+	FNR == 1 { next }
+	NR == FNR { key = $1 "," $2 "," $3 "," $4; baseGbps[key] = $6; baseNs[key] = $5; baseNoise[key] = $8; next }
+	{
+		key = $1 "," $2 "," $3 "," $4
+		if (!(key in baseNs)) {
+			next
+		}
+		if ($6 != "" && baseGbps[key] != "") {
+			change = ($6 - baseGbps[key]) * 100 / baseGbps[key]
+		} else if ($5 > 0) {
+			change = (baseNs[key] - $5) * 100 / $5
+		} else {
+			next
+		}
+		tolerance = baseNoise[key] + $8
+		if (tolerance < threshold) {
+			tolerance = threshold
+		}
+		if (change < -tolerance) {
+			printf("REGRESSION %s: %.1f%% (tolerance %.1f%%)\n", key, change, tolerance)
+			regressions++
+		}
+	}
+	END {
+		printf("%d regression(s) beyond max(%s%%, noise)\n", regressions, threshold)
+		exit (regressions > 0) ? 2 : 0
+	}
+' "$baseline" "$results"
@@ -1,2 +1,2 @@
 #!/bin/sh
-clang -O1 -g -o test main.c -march=armv8+memtag -Wall
\ No newline at end of file
+clang -O1 -g -o test test.c -march=armv8.5-a+memtag -Wall
\ No newline at end of file
@@ -6,12 +6,15 @@
  * @copyright Copyright (c) CreepNT 2022
  * @todo Verify emitted assembly is correct
  * @todo If NO_INTRINSICS, add replacement for some intrinsics
- * @todo Add support for DC GVA
  */
 
+#ifndef MTELIB_H
+#define MTELIB_H
+
 #include <assert.h> //assert
 #include <stddef.h> //size_t
 #include <stdint.h> //uint64_t, uintptr_t
+#include <string.h> //memcpy
 
 #ifndef MTE_ASSERT
     #define MTE_ASSERT(condition, errormsg) assert(condition && __FILE__ && __LINE__ && errormsg)
@@ -28,6 +31,13 @@
 //MTELIB_NO_INTRINSICS: disables usage of intrinsics.
 //MTELIB_NO_INLINE_ASSEMBLY: disables usage of inline assembly.
 //MTELIB_DISABLE_DGRANULE_OPERATIONS: disables usage of double-granule operations.
+//MTELIB_DISABLE_DC_GVA: disables usage of DC GVA/DC GZVA for large areas.
+//MTELIB_DISABLE_SMALL_SIZE_PATH: disables the straight-line sequences used for small areas.
+//MTELIB_DC_GVA_THRESHOLD: minimum size (in bytes) of an area for DC GVA/DC GZVA to be used.
+//MTELIB_COPY_PREFETCH_THRESHOLD: minimum size (in bytes) of a copy for the source to be prefetched.
+//MTELIB_COPY_PREFETCH_DISTANCE: how far ahead (in bytes) of the copy the source is prefetched.
+//MTELIB_PRIVILEGED: code runs at EL1 or higher, enables usage of GMID_EL1 and of LDGM/STGM.
+//MTELIB_STATS: enables per-thread instrumentation counters of tagging primitives.
 
 #if defined(MTELIB_NO_INTRINSICS) && defined(MTELIB_NO_INLINE_ASSEMBLY) 
 #error Cannot disable both intrinsics and inline ASM.
@@ -61,6 +71,13 @@
 #endif
 
 #define MTELIBEXPORT extern inline
+#define MTELIBINTERNAL static inline
+
+#ifdef __cplusplus
+    #define MTELIB_THREAD_LOCAL thread_local
+#else
+    #define MTELIB_THREAD_LOCAL _Thread_local
+#endif
 
 /* ... */
 
@@ -80,12 +97,171 @@ static_assert(DGRANULE_SIZE == 32, "Bad DGRANULE size");
 static_assert(GRANULE_ALIGNMENT_MASK == 0xF,   "Bad granule alignment");
 static_assert(DGRANULE_ALIGNMENT_MASK == 0x1F, "Bad DGRANULE alignment");
 
+#ifndef MTELIB_DC_GVA_THRESHOLD
+    #define MTELIB_DC_GVA_THRESHOLD (4096U)
+#endif
+
+#ifndef MTELIB_COPY_PREFETCH_THRESHOLD
+    #define MTELIB_COPY_PREFETCH_THRESHOLD (16384U)
+#endif
+
+#ifndef MTELIB_COPY_PREFETCH_DISTANCE
+    #define MTELIB_COPY_PREFETCH_DISTANCE (512U)
+#endif
+
+#define COPY_BLOCK_SIZE (64U) //Bytes handled by each iteration of the unrolled copy loop
+#define SMALL_TAG_MAX_SIZE (256U) //Largest area handled by the straight-line tagging sequences
+
+#define DCZID_BS_MASK  (0xFULL)
+#define DCZID_DZP_BIT  (1ULL << 4)
+#define GMID_BS_MASK   (0xFULL)
+
+//Packed tag arrays hold one tag per nibble, the tag of even granules being in the low nibble.
+#define PACKED_TAGS_SIZE(size)   ((((size) >> LOG2_TAG_GRANULE_SIZE) + 1) / 2)
+
+/* Instrumentation counters */
+#ifdef MTELIB_STATS
+typedef enum MTEStatsOp {
+    MTE_STATS_OP_TAG,           //memoryTag
+    MTE_STATS_OP_TAG_AND_ZERO,  //memoryTagAndZero, memoryTagAndZeroStreaming
+    MTE_STATS_OP_TAG_AND_COPY,  //memoryTagAndCopy
+    MTE_STATS_OP_TAG_AND_INIT,  //memoryTagAndInit, memoryTagAndFill
+    MTE_STATS_OP_RANDOM_TAG,    //pointerSetRandomTag, tagGeneratorSetTag (size is 0)
+    MTE_STATS_NUM_OPS,
+} MTEStatsOp;
+
+//Main instruction used by a call: zeroing variants (STZG, STZ2G, DC GZVA) are counted with their tag-only counterpart.
+typedef enum MTEStatsKernel {
+    MTE_STATS_KERNEL_NONE,      //Tag generation only
+    MTE_STATS_KERNEL_STG,
+    MTE_STATS_KERNEL_ST2G,
+    MTE_STATS_KERNEL_STGP,
+    MTE_STATS_KERNEL_DC_GVA,
+    MTE_STATS_NUM_KERNELS,
+} MTEStatsKernel;
+
+//Bucket i counts calls of GRANULE_SIZE << i bytes up to twice that, the last bucket also counts all larger calls.
+#define MTE_STATS_NUM_BUCKETS (20U)
+
+typedef struct MTEStats {
+    uint64_t calls[MTE_STATS_NUM_OPS];
+    uint64_t bytes[MTE_STATS_NUM_OPS];
+    uint64_t ticks[MTE_STATS_NUM_OPS];  //CNTVCT_EL0 ticks spent, see mteStatsTickFrequency
+    uint64_t buckets[MTE_STATS_NUM_OPS][MTE_STATS_NUM_BUCKETS];
+    uint64_t kernels[MTE_STATS_NUM_KERNELS];
+    uint64_t tagFaults;                 //Counted by mteStatsRecordTagFault
+} MTEStats;
+
+/**
+ * @brief Get the counters of the calling thread
+ * 
+ * @return Counters, only ever written to by the calling thread
+ */
+MTELIBEXPORT MTEStats* mteStatsCurrent(void) {
+    static MTELIB_THREAD_LOCAL MTEStats stats;
+    return &stats;
+}
+
+//No ISB: the read may be reordered by a few instructions, which is fine for accumulated totals.
+MTELIBINTERNAL uint64_t mteStatsReadTicks(void) {
+  #ifndef MTELIB_NO_INLINE_ASSEMBLY
+    uint64_t ticks;
+    MTE_ASM("MRS %0, CNTVCT_EL0" : "=r"(ticks));
+    return ticks;
+  #else
+    return __arm_rsr64("CNTVCT_EL0");
+  #endif
+}
+
+MTELIBINTERNAL void mteStatsRecord(MTEStatsOp op, size_t size, MTEStatsKernel kernel, uint64_t start) {
+    MTEStats* const stats = mteStatsCurrent();
+    const uint64_t granules = (uint64_t)(size >> LOG2_TAG_GRANULE_SIZE);
+    const unsigned log2 = (granules != 0) ? 63U - (unsigned)__builtin_clzll(granules) : 0;
+
+    stats->ticks[op] += mteStatsReadTicks() - start;
+    stats->calls[op]++;
+    stats->bytes[op] += size;
+    stats->buckets[op][(log2 < MTE_STATS_NUM_BUCKETS) ? log2 : MTE_STATS_NUM_BUCKETS - 1]++;
+    stats->kernels[kernel]++;
+}
+
+/**
+ * @brief Get the frequency of the counter stats ticks are measured with
+ * 
+ * @return Frequency in Hz (CNTFRQ_EL0)
+ */
+MTELIBEXPORT uint64_t mteStatsTickFrequency(void) {
+  #ifndef MTELIB_NO_INLINE_ASSEMBLY
+    uint64_t frequency;
+    MTE_ASM("MRS %0, CNTFRQ_EL0" : "=r"(frequency));
+    return frequency;
+  #else
+    return __arm_rsr64("CNTFRQ_EL0");
+  #endif
+}
+
+/**
+ * @brief Copy the counters of the calling thread
+ * 
+ * @param out Receives the counters
+ * @param reset Whether the counters of the calling thread are reset afterwards
+ * @note Counters aren't atomic: each thread must take its own snapshot (e.g. from its event loop), and
+ *       snapshots can then be merged using mteStatsAccumulate.
+ */
+MTELIBEXPORT void mteStatsSnapshot(MTEStats* out, int reset) {
+    MTEStats* const stats = mteStatsCurrent();
+    *out = *stats;
+    if (reset) {
+        uint64_t* const counters = (uint64_t*)stats;
+        for (size_t i = 0; i < sizeof(MTEStats) / sizeof(uint64_t); i++) {
+            counters[i] = 0;
+        }
+    }
+}
+
+/**
+ * @brief Add counters to a total
+ * 
+ * @param total Counters receiving the sum
+ * @param stats Counters to add
+ */
+MTELIBEXPORT void mteStatsAccumulate(MTEStats* total, const MTEStats* stats) {
+    uint64_t* const out = (uint64_t*)total;
+    const uint64_t* const in = (const uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(MTEStats) / sizeof(uint64_t); i++) {
+        out[i] += in[i];
+    }
+}
+
+/**
+ * @brief Count a tag check fault, from the SIGSEGV handler of the faulting thread
+ * 
+ * @note Async-signal-safe.
+ */
+MTELIBEXPORT void mteStatsRecordTagFault(void) {
+    mteStatsCurrent()->tagFaults++;
+}
+
+    #define MTE_STATS_BEGIN() const uint64_t mteStatsStart = mteStatsReadTicks()
+    #define MTE_STATS_END(op, size, kernel) mteStatsRecord(op, size, kernel, mteStatsStart)
+#else
+    #define MTE_STATS_BEGIN()
+    #define MTE_STATS_END(...)
+#endif
+
+//Kernel used by the granule loops for an area of the given size
+#ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+    #define MTE_STATS_LOOP_KERNEL(size) (((size) >= DGRANULE_SIZE) ? MTE_STATS_KERNEL_ST2G : MTE_STATS_KERNEL_STG)
+#else
+    #define MTE_STATS_LOOP_KERNEL(size) MTE_STATS_KERNEL_STG
+#endif
+
 /* Exclude mask manipulation primitives */
 typedef uint64_t ExcludeMask;
 
 MTELIBEXPORT ExcludeMask excludeMaskAddPtrTag(ExcludeMask mask, void* ptr) {
 #ifndef MTELIB_NO_INTRINSICS
-    return (ExcludeMask)__arm_mte_exlude_tag(ptr, mask);
+    return (ExcludeMask)__arm_mte_exclude_tag(ptr, mask);
 #else
     ExcludeMask newMask;
 	MTE_ASM("GMI %0, %1, %2" :  "=r"(newMask) : "r"(ptr), "r"(mask));
@@ -95,12 +271,12 @@ MTELIBEXPORT ExcludeMask excludeMaskAddPtrTag(ExcludeMask mask, void* ptr) {
 
 MTELIBEXPORT ExcludeMask excludeMaskAddTag(ExcludeMask mask, uint64_t tag) {
 	VERIFY_VALID_TAG(tag);
-	return mask | (1 << tag);
+	return mask | (1ULL << tag);
 }
 
 MTELIBEXPORT ExcludeMask excludeMaskRemoveTag(ExcludeMask mask, uint64_t tag) {
     VERIFY_VALID_TAG(tag);
-    return mask & ~(1 << tag);
+    return mask & ~(1ULL << tag);
 }
 
 /* Pointer tagging primitives */
@@ -115,34 +291,199 @@ MTELIBEXPORT uint64_t pointerGetTag(void* ptr) {
 	return (((uintptr_t)ptr) >> TAG_SHIFT) & MAX_TAG;
 }
 
-#ifndef MTELIB_NO_INTRINSICS
+#if !defined(MTELIB_NO_INTRINSICS) && !defined(MTELIB_STATS)
     #define pointerSetRandomTag(ptr, excluded) __arm_mte_create_random_tag(ptr, excluded)
 #else
 MTELIBEXPORT void* pointerSetRandomTag(void* ptr, ExcludeMask excluded) {
+    MTE_STATS_BEGIN();
+  #ifdef MTELIB_NO_INTRINSICS
 	void* tagged;
 	MTE_ASM("IRG %0, %1, %2" : "=r"(tagged) : "r"(ptr), "r"(excluded));
+  #else
+    void* const tagged = __arm_mte_create_random_tag(ptr, excluded);
+  #endif
+    MTE_STATS_END(MTE_STATS_OP_RANDOM_TAG, 0, MTE_STATS_KERNEL_NONE);
 	return tagged;
 }
 #endif
 
-/* Memory tagging/manipulation "primitives" */
+/**
+ * @brief Generate random tags for consecutive slots, with neighbouring slots never sharing a tag
+ * 
+ * @param out Array receiving count tagged pointers, the i-th one pointing to base + i * stride
+ * @param base Pointer to the first slot
+ * @param stride Distance between slots, in bytes
+ * @param count Number of slots
+ * @param excluded Tags that must never be generated
+ * @note Even slots are generated first, without any dependency between them so that IRGs overlap.
+ *       Odd slots are then generated excluding the tags of both their neighbours.
+ */
+MTELIBEXPORT void pointerSetRandomTags(void** out, void* base, size_t stride, size_t count, ExcludeMask excluded) {
+    char* const slots = (char*)base;
+
+    for (size_t i = 0; i < count; i += 2) {
+        out[i] = pointerSetRandomTag(slots + i * stride, excluded);
+    }
+
+    for (size_t i = 1; i < count; i += 2) {
+        ExcludeMask neighbours = excludeMaskAddPtrTag(excluded, out[i - 1]);
+        if (i + 1 < count) {
+            neighbours = excludeMaskAddPtrTag(neighbours, out[i + 1]);
+        }
+        out[i] = pointerSetRandomTag(slots + i * stride, neighbours);
+    }
+}
+
+/* Deterministic tag generation primitives */
+//Seeded xorshift64* generator, for reproducible benchmarks and replays.
+typedef struct TagGenerator {
+    uint64_t state;
+} TagGenerator;
+
+MTELIBEXPORT void tagGeneratorSeed(TagGenerator* gen, uint64_t seed) {
+    //xorshift gets stuck on a zero state
+    gen->state = (seed != 0) ? seed : 0x9E3779B97F4A7C15ULL;
+}
 
 /**
- * @brief Tag an area of memory
+ * @brief Set a pseudo-random tag in a pointer, using a seeded generator
  * 
- * @param ptr Tagged pointer to area that gets tagged with the tag in ptr itself
- * @param size Size of the area to tag (Aligned to tag boundary)
- * @note If ptr isn't aligned to tag boundary, more than size bytes will be tagged.
+ * @param gen Generator to draw the tag from
+ * @param ptr Pointer to tag
+ * @param excluded Tags that must not be generated
+ * @return Tagged pointer
+ * @note Like IRG, tag 0 is generated if all tags are excluded. Unlike IRG, GCR_EL1.Exclude isn't
+ *       taken into account: tags excluded via prctl() must be part of excluded.
  */
-MTELIBEXPORT void memoryTag(void* ptr, size_t size) {
-    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
-    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+MTELIBEXPORT void* tagGeneratorSetTag(TagGenerator* gen, void* ptr, ExcludeMask excluded) {
+    MTE_STATS_BEGIN();
+    const uint64_t allowed = ~excluded & 0xFFFFULL;
+    if (allowed == 0) {
+        MTE_STATS_END(MTE_STATS_OP_RANDOM_TAG, 0, MTE_STATS_KERNEL_NONE);
+        return pointerSetTag(ptr, 0);
+    }
 
-	void* const end = ((char*)ptr + size); //TODO: ensure this is using the safe pointer addition instruction
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    const uint64_t random = gen->state * 0x2545F4914F6CDD1DULL;
 
+    //Pick the n-th allowed tag, n being uniform in [0; number of allowed tags[
+    uint64_t n = ((random >> 32) * (uint64_t)__builtin_popcountll(allowed)) >> 32;
+    uint64_t remaining = allowed;
+    while (n-- != 0) {
+        remaining &= remaining - 1;
+    }
+    MTE_STATS_END(MTE_STATS_OP_RANDOM_TAG, 0, MTE_STATS_KERNEL_NONE);
+    return pointerSetTag(ptr, (uint64_t)__builtin_ctzll(remaining));
+}
+
+/**
+ * @brief Get the tag generator selected for the calling thread
+ * 
+ * @return Slot holding the generator used by pointerSetTagFromSource, or NULL for IRG
+ */
+MTELIBEXPORT TagGenerator** tagGeneratorCurrent(void) {
+    static MTELIB_THREAD_LOCAL TagGenerator* current = NULL;
+    return &current;
+}
+
+/**
+ * @brief Select the tag source of the calling thread
+ * 
+ * @param gen Generator to use from now on, or NULL to use IRG
+ */
+MTELIBEXPORT void tagGeneratorSelect(TagGenerator* gen) {
+    *tagGeneratorCurrent() = gen;
+}
+
+/**
+ * @brief Set a random tag in a pointer, from the tag source selected for the calling thread
+ * 
+ * @param ptr Pointer to tag
+ * @param excluded Tags that must not be generated
+ * @return Tagged pointer, using IRG unless a generator was selected with tagGeneratorSelect
+ */
+MTELIBEXPORT void* pointerSetTagFromSource(void* ptr, ExcludeMask excluded) {
+    TagGenerator* const gen = *tagGeneratorCurrent();
+    if (gen != NULL) {
+        return tagGeneratorSetTag(gen, ptr, excluded);
+    }
+    return pointerSetRandomTag(ptr, excluded);
+}
+
+/* Packed tag arrays manipulation primitives */
+MTELIBEXPORT uint64_t packedTagsGet(const uint8_t* tags, size_t granule) {
+    return (tags[granule >> 1] >> ((granule & 1) * 4)) & MAX_TAG;
+}
+
+MTELIBEXPORT void packedTagsSet(uint8_t* tags, size_t granule, uint64_t tag) {
+    VERIFY_VALID_TAG(tag);
+    const unsigned shift = (granule & 1) * 4;
+    tags[granule >> 1] = (uint8_t)((tags[granule >> 1] & ~(MAX_TAG << shift)) | (tag << shift));
+}
+
+/* Tag check override primitives */
+/**
+ * @brief Disable tag checks of the calling thread (PSTATE.TCO), until tagChecksRestore is called
+ * 
+ * @return Previous tag check override state, to give back to tagChecksRestore
+ * @note Scopes can be nested. Meant for loops going through trusted memory, whose pointer tags may not match.
+ * @note Compiled away if MTELIB_NO_INLINE_ASSEMBLY is set: tag checks then stay enabled.
+ */
+MTELIBEXPORT uint64_t tagChecksSuppress(void) {
 #ifndef MTELIB_NO_INLINE_ASSEMBLY
+    uint64_t previous;
+    MTE_ASM("MRS %0, TCO\n\t"
+            "MSR TCO, #1"
+        : "=r"(previous) :: "memory");
+    return previous;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Restore the tag check override state of the calling thread
+ * 
+ * @param previous Value returned by the matching tagChecksSuppress
+ */
+MTELIBEXPORT void tagChecksRestore(uint64_t previous) {
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    MTE_ASM("MSR TCO, %0" :: "r"(previous) : "memory");
+#else
+    (void)previous;
+#endif
+}
+
+/* Memory tagging/manipulation "primitives" */
+
+/**
+ * @brief Get the size of blocks operated on by DC GVA/DC GZVA
+ * 
+ * @return Block size in bytes, or 0 if DC GVA/DC GZVA cannot be used
+ * @note DCZID_EL0 is only read on first call, the result is cached afterwards.
+ */
+MTELIBEXPORT size_t memoryGetDCZBlockSize(void) {
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_DC_GVA)
+    static size_t blockSize = (size_t)-1;
+    if (blockSize == (size_t)-1) {
+        uint64_t dczid;
+        MTE_ASM("MRS %0, DCZID_EL0" : "=r"(dczid));
+        //DCZID_EL0.BS is log2 of the block size in 4-byte words
+        blockSize = (dczid & DCZID_DZP_BIT) ? 0 : ((size_t)4U << (dczid & DCZID_BS_MASK));
+    }
+    return blockSize;
+#else
+    return 0;
+#endif
+}
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+//Granule loops used for small areas, and for the head/tail of areas handled by DC GVA/DC GZVA.
+MTELIBINTERNAL void memoryTagLoop(void* ptr, void* const end) {
   #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
-	if ((size & DGRANULE_ALIGNMENT_MASK) != 0) {
+	if ((((uintptr_t)end - (uintptr_t)ptr) & DGRANULE_ALIGNMENT_MASK) != 0) {
 		MTE_ASM("STG %0, [%0], #16" : "+r"(ptr));
 	}
 
@@ -154,12 +495,159 @@ MTELIBEXPORT void memoryTag(void* ptr, size_t size) {
         MTE_ASM("STG %0, [%0], #16" : "+r"(ptr));
     }
   #endif
+}
+
+MTELIBINTERNAL void memoryTagAndZeroLoop(void* ptr, void* const end) {
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+	if ((((uintptr_t)end - (uintptr_t)ptr) & DGRANULE_ALIGNMENT_MASK) != 0) {
+		MTE_ASM("STZG %0, [%0], #16" : "+r"(ptr) :: "memory");
+	}
+
+	while (ptr < end) {
+		MTE_ASM("STZ2G %0, [%0], #32" : "+r"(ptr) :: "memory");
+	}
+  #else
+    while (ptr < end) {
+        MTE_ASM("STZG %0, [%0], #16" : "+r"(ptr) :: "memory");
+    }
+  #endif
+}
+#endif
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_SMALL_SIZE_PATH)
+//Straight-line sequences for small areas: a sequence of SMALL_TAG_MAX_SIZE / step stores, going backwards from the end of
+//the area, is entered at the store that covers exactly the size of the area. Each entry is a single instruction, preceded by
+//a landing pad when indirect branches are protected (as is the end of the sequence, entered when no store is needed).
+  #ifdef __ARM_FEATURE_BTI_DEFAULT
+    #define MTELIB_SMALL_ENTRY_PAD  "BTI j\n"
+    #define MTELIB_SMALL_ENTRY_LOG2 "3"
+  #else
+    #define MTELIB_SMALL_ENTRY_PAD  ""
+    #define MTELIB_SMALL_ENTRY_LOG2 "2"
+  #endif
+
+  #define MTELIB_SMALL_ENTRY \
+    "ADR %[entry], 1f\n" \
+    "SUB %[entry], %[entry], %[stores], LSL #" MTELIB_SMALL_ENTRY_LOG2 "\n"
+
+  #define MTELIB_SMALL_STORES(op, count, step) \
+    ".set .Lmtelib_small_offset, -" #count " * " #step "\n" \
+    ".rept " #count "\n" \
+    MTELIB_SMALL_ENTRY_PAD \
+    op " %[end], [%[end], #.Lmtelib_small_offset]\n" \
+    ".set .Lmtelib_small_offset, .Lmtelib_small_offset + " #step "\n" \
+    ".endr\n" \
+    "1:\n" \
+    MTELIB_SMALL_ENTRY_PAD
+
+  #define MTELIB_SMALL_SEQUENCE(op, count, step) \
+    MTELIB_SMALL_ENTRY \
+    "BR %[entry]\n" \
+    MTELIB_SMALL_STORES(op, count, step)
+
+//Double-granule variant: when the area spans an odd number of granules, the branch goes (through CSEL, so without a
+//conditional branch) to a single-granule store of the first granule, which then enters the sequence of double-granule stores.
+  #define MTELIB_SMALL_DGRANULE_SEQUENCE(single, pair) \
+    MTELIB_SMALL_ENTRY \
+    "ADR %[odd], 2f\n" \
+    "TST %[size], #16\n" \
+    "CSEL %[odd], %[odd], %[entry], NE\n" \
+    "BR %[odd]\n" \
+    "2:\n" \
+    MTELIB_SMALL_ENTRY_PAD \
+    single " %[ptr], [%[ptr]]\n" \
+    "BR %[entry]\n" \
+    MTELIB_SMALL_STORES(pair, 8, 32)
+
+static_assert(SMALL_TAG_MAX_SIZE == 256, "Straight-line tagging sequences are written for 256 bytes");
+
+//Tag 0 < size <= SMALL_TAG_MAX_SIZE bytes. With double-granule operations, the first granule is only tagged separately
+//if size isn't a multiple of DGRANULE_SIZE, so that the rest is a whole number of ST2G.
+MTELIBINTERNAL void memoryTagSmall(void* ptr, size_t size) {
+    void* const end = (char*)ptr + size;
+    void* entry;
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+    void* odd;
+    MTE_ASM(MTELIB_SMALL_DGRANULE_SEQUENCE("STG", "ST2G")
+            : [entry] "=&r"(entry), [odd] "=&r"(odd)
+            : [ptr] "r"(ptr), [end] "r"(end), [size] "r"(size), [stores] "r"(size >> LOG2_DGRANULE_SIZE)
+            : "cc");
+  #else
+    MTE_ASM(MTELIB_SMALL_SEQUENCE("STG", 16, 16)
+            : [entry] "=&r"(entry)
+            : [end] "r"(end), [stores] "r"(size >> LOG2_TAG_GRANULE_SIZE));
+  #endif
+}
+
+MTELIBINTERNAL void memoryTagAndZeroSmall(void* ptr, size_t size) {
+    void* const end = (char*)ptr + size;
+    void* entry;
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+    void* odd;
+    MTE_ASM(MTELIB_SMALL_DGRANULE_SEQUENCE("STZG", "STZ2G")
+            : [entry] "=&r"(entry), [odd] "=&r"(odd)
+            : [ptr] "r"(ptr), [end] "r"(end), [size] "r"(size), [stores] "r"(size >> LOG2_DGRANULE_SIZE)
+            : "cc", "memory");
+  #else
+    MTE_ASM(MTELIB_SMALL_SEQUENCE("STZG", 16, 16)
+            : [entry] "=&r"(entry)
+            : [end] "r"(end), [stores] "r"(size >> LOG2_TAG_GRANULE_SIZE)
+            : "memory");
+  #endif
+}
+#endif
+
+/**
+ * @brief Tag an area of memory
+ * 
+ * @param ptr Tagged pointer to area that gets tagged with the tag in ptr itself
+ * @param size Size of the area to tag (Aligned to tag boundary)
+ * @note If ptr isn't aligned to tag boundary, more than size bytes will be tagged.
+ * @note Areas of at least MTELIB_DC_GVA_THRESHOLD bytes are tagged using DC GVA.
+ * @note Areas of at most SMALL_TAG_MAX_SIZE bytes are tagged without any loop.
+ */
+MTELIBEXPORT void memoryTag(void* ptr, size_t size) {
+    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+    MTE_STATS_BEGIN();
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_SMALL_SIZE_PATH)
+    if (size - 1 < SMALL_TAG_MAX_SIZE) { //Also excludes size == 0
+        memoryTagSmall(ptr, size);
+        MTE_STATS_END(MTE_STATS_OP_TAG, size, MTE_STATS_LOOP_KERNEL(size));
+        return;
+    }
+#endif
+
+	void* const end = ((char*)ptr + size); //Can't carry into the tag: user space addresses are below 2^56
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+  #ifndef MTELIB_DISABLE_DC_GVA
+    const size_t blockSize = (size >= MTELIB_DC_GVA_THRESHOLD) ? memoryGetDCZBlockSize() : 0;
+    if (blockSize != 0) {
+        //DC GVA ignores the low bits of the address, so only use it on whole blocks.
+        char* block = (char*)(((uintptr_t)ptr + blockSize - 1) & ~(uintptr_t)(blockSize - 1));
+        char* const blocksEnd = (char*)((uintptr_t)end & ~(uintptr_t)(blockSize - 1));
+        if (block < blocksEnd) {
+            memoryTagLoop(ptr, block);
+            for (; block < blocksEnd; block += blockSize) {
+                MTE_ASM("DC GVA, %0" :: "r"(block));
+            }
+            memoryTagLoop(blocksEnd, end);
+            MTE_STATS_END(MTE_STATS_OP_TAG, size, MTE_STATS_KERNEL_DC_GVA);
+            return;
+        }
+    }
+  #endif
+    memoryTagLoop(ptr, end);
+    MTE_STATS_END(MTE_STATS_OP_TAG, size, MTE_STATS_LOOP_KERNEL(size));
 #else
     const char* out = (const char*)ptr;
     while (out < end) {
         __arm_mte_set_tag(out);
         out += GRANULE_SIZE;
     }
+    MTE_STATS_END(MTE_STATS_OP_TAG, size, MTE_STATS_KERNEL_STG);
 #endif
 }
 
@@ -170,37 +658,249 @@ MTELIBEXPORT void memoryTag(void* ptr, size_t size) {
  * @param size Size of the area to zero out
  * @note ptr must be aligned to tag boundary
  * @note size must be aligned to tag boundary
+ * @note Areas of at least MTELIB_DC_GVA_THRESHOLD bytes are zero'ed and tagged using DC GZVA.
+ * @note Areas of at most SMALL_TAG_MAX_SIZE bytes are zero'ed and tagged without any loop.
  */
 MTELIBEXPORT void memoryTagAndZero(void* ptr, size_t size) {
     //Unlike STG, STZG aborts if the pointer is not aligned to tag granule size.
     VERIFY_ALIGNMENT_CRITICAL(ptr, GRANULE_ALIGNMENT_MASK);
     VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+    MTE_STATS_BEGIN();
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_SMALL_SIZE_PATH)
+    if (size - 1 < SMALL_TAG_MAX_SIZE) { //Also excludes size == 0
+        memoryTagAndZeroSmall(ptr, size);
+        MTE_STATS_END(MTE_STATS_OP_TAG_AND_ZERO, size, MTE_STATS_LOOP_KERNEL(size));
+        return;
+    }
+#endif
 
 #ifndef MTELIB_NO_INLINE_ASSEMBLY
 	void* const end = ((char*)ptr + size);
-  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
-	if ((size & DGRANULE_ALIGNMENT_MASK) != 0) {
-		MTE_ASM("STZG %0, [%0], #16" : "+r"(ptr) :: "memory");
-	}
-
-	while (ptr < end) {
-		MTE_ASM("STZ2G %0, [%0], #32" : "+r"(ptr) :: "memory");
-	}
-  #else
-    while (ptr < end) {
-        MTE_ASM("STZG %0, [%0], #16" : "+r"(ptr) :: "memory");
+  #ifndef MTELIB_DISABLE_DC_GVA
+    const size_t blockSize = (size >= MTELIB_DC_GVA_THRESHOLD) ? memoryGetDCZBlockSize() : 0;
+    if (blockSize != 0) {
+        char* block = (char*)(((uintptr_t)ptr + blockSize - 1) & ~(uintptr_t)(blockSize - 1));
+        char* const blocksEnd = (char*)((uintptr_t)end & ~(uintptr_t)(blockSize - 1));
+        if (block < blocksEnd) {
+            memoryTagAndZeroLoop(ptr, block);
+            for (; block < blocksEnd; block += blockSize) {
+                MTE_ASM("DC GZVA, %0" :: "r"(block) : "memory");
+            }
+            memoryTagAndZeroLoop(blocksEnd, end);
+            MTE_STATS_END(MTE_STATS_OP_TAG_AND_ZERO, size, MTE_STATS_KERNEL_DC_GVA);
+            return;
+        }
     }
   #endif
+    memoryTagAndZeroLoop(ptr, end);
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_ZERO, size, MTE_STATS_LOOP_KERNEL(size));
 #else
-    uint64_t* in = (uint64_t*)src;
-    uint64_t* out = (uint64_t*)dst;
-    uint64_t* const end = (uint64_t*)((char*)dst + size);
+    uint64_t* out = (uint64_t*)ptr;
+    uint64_t* const end = (uint64_t*)((char*)ptr + size);
     while (out < end) {
         __arm_mte_set_tag(out);
-        out[0] = in[0];
-        out[1] = in[1];
-        out += 2; in += 2;
+        out[0] = 0;
+        out[1] = 0;
+        out += 2;
+    }
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_ZERO, size, MTE_STATS_KERNEL_STG);
+#endif
+}
+
+/**
+ * @brief Get the size of blocks operated on by LDGM/STGM
+ * 
+ * @return Block size in bytes, or 0 if LDGM/STGM cannot be used
+ * @note GMID_EL1 is only read on first call, the result is cached afterwards.
+ * @note LDGM/STGM are UNDEFINED at EL0, so this always returns 0 unless MTELIB_PRIVILEGED is set.
+ */
+MTELIBEXPORT size_t memoryGetGMBlockSize(void) {
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && defined(MTELIB_PRIVILEGED)
+    static size_t blockSize = 0;
+    if (blockSize == 0) {
+        uint64_t gmid;
+        MTE_ASM("MRS %0, GMID_EL1" : "=r"(gmid));
+        //GMID_EL1.BS is log2 of the block size in 4-byte words
+        blockSize = (size_t)4U << (gmid & GMID_BS_MASK);
+    }
+    return blockSize;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Read the allocation tag of a granule
+ * 
+ * @param ptr Pointer to the granule
+ * @return Allocation tag of the granule containing ptr
+ */
+MTELIBEXPORT uint64_t memoryGetTag(const void* ptr) {
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    const void* tagged = ptr;
+    MTE_ASM("LDG %0, [%1]" : "+r"(tagged) : "r"(ptr));
+    return pointerGetTag((void*)tagged);
+#else
+    return pointerGetTag(__arm_mte_get_tag(ptr));
+#endif
+}
+
+/**
+ * @brief Read the allocation tags of an area of memory into a packed tag array
+ * 
+ * @param ptr Pointer to the area
+ * @param size Size of the area (Aligned to tag boundary)
+ * @param tags Packed tag array receiving the tags (at least PACKED_TAGS_SIZE(size) bytes)
+ * @note If MTELIB_PRIVILEGED is set, whole LDGM blocks are read using a single LDGM each.
+ */
+MTELIBEXPORT void memoryGetTags(const void* ptr, size_t size, uint8_t* tags) {
+    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+
+    const char* in = (const char*)ptr;
+    const size_t numGranules = size >> LOG2_TAG_GRANULE_SIZE;
+    size_t granule = 0;
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && defined(MTELIB_PRIVILEGED)
+    const size_t blockSize = memoryGetGMBlockSize();
+    const size_t blockGranules = blockSize >> LOG2_TAG_GRANULE_SIZE;
+
+    //Read single granules up to the first block boundary
+    for (; granule < numGranules && ((uintptr_t)in & (blockSize - 1)) != 0; granule++, in += GRANULE_SIZE) {
+        packedTagsSet(tags, granule, memoryGetTag(in));
+    }
+
+    for (; numGranules - granule >= blockGranules; granule += blockGranules, in += blockSize) {
+        uint64_t blockTags;
+        MTE_ASM("LDGM %0, [%1]" : "=r"(blockTags) : "r"(in));
+        //The tag of each granule is at nibble address[7:4] of the register
+        if (blockGranules == 16 && (granule & 1) == 0) {
+            for (size_t i = 0; i < 8; i++) {
+                tags[(granule >> 1) + i] = (uint8_t)(blockTags >> (i * 8));
+            }
+        } else {
+            const unsigned firstNibble = ((uintptr_t)in >> LOG2_TAG_GRANULE_SIZE) & 0xF;
+            for (size_t i = 0; i < blockGranules; i++) {
+                packedTagsSet(tags, granule + i, (blockTags >> ((firstNibble + i) * 4)) & MAX_TAG);
+            }
+        }
+    }
+#endif
+
+    for (; granule < numGranules; granule++, in += GRANULE_SIZE) {
+        packedTagsSet(tags, granule, memoryGetTag(in));
+    }
+}
+
+/**
+ * @brief Tag an area of memory from a packed tag array
+ * 
+ * @param ptr Pointer to the area (its tag is ignored)
+ * @param size Size of the area (Aligned to tag boundary)
+ * @param tags Packed tag array holding the tags (at least PACKED_TAGS_SIZE(size) bytes)
+ * @note If MTELIB_PRIVILEGED is set, whole STGM blocks are tagged using a single STGM each.
+ * @note Pairs of granules with the same tag are tagged using ST2G.
+ */
+MTELIBEXPORT void memorySetTags(void* ptr, size_t size, const uint8_t* tags) {
+    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+
+    char* out = (char*)ptr;
+    const size_t numGranules = size >> LOG2_TAG_GRANULE_SIZE;
+    size_t granule = 0;
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && defined(MTELIB_PRIVILEGED)
+    const size_t blockSize = memoryGetGMBlockSize();
+    const size_t blockGranules = blockSize >> LOG2_TAG_GRANULE_SIZE;
+
+    //Tag single granules up to the first block boundary
+    for (; granule < numGranules && ((uintptr_t)out & (blockSize - 1)) != 0; granule++, out += GRANULE_SIZE) {
+        MTE_ASM("STG %0, [%0]" :: "r"(pointerSetTag(out, packedTagsGet(tags, granule))));
+    }
+
+    for (; numGranules - granule >= blockGranules; granule += blockGranules, out += blockSize) {
+        //The tag of each granule is at nibble address[7:4] of the register
+        uint64_t blockTags = 0;
+        if (blockGranules == 16 && (granule & 1) == 0) {
+            for (size_t i = 0; i < 8; i++) {
+                blockTags |= (uint64_t)tags[(granule >> 1) + i] << (i * 8);
+            }
+        } else {
+            const unsigned firstNibble = ((uintptr_t)out >> LOG2_TAG_GRANULE_SIZE) & 0xF;
+            for (size_t i = 0; i < blockGranules; i++) {
+                blockTags |= packedTagsGet(tags, granule + i) << ((firstNibble + i) * 4);
+            }
+        }
+        MTE_ASM("STGM %0, [%1]" :: "r"(blockTags), "r"(out));
+    }
+#endif
+
+    while (granule < numGranules) {
+        void* const tagged = pointerSetTag(out, packedTagsGet(tags, granule));
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+        if (granule + 1 < numGranules && packedTagsGet(tags, granule + 1) == pointerGetTag(tagged)) {
+            MTE_ASM("ST2G %0, [%0]" :: "r"(tagged));
+            granule += 2; out += DGRANULE_SIZE;
+            continue;
+        }
+  #endif
+        MTE_ASM("STG %0, [%0]" :: "r"(tagged));
+#else
+        __arm_mte_set_tag(tagged);
+#endif
+        granule++; out += GRANULE_SIZE;
+    }
+}
+
+/**
+ * @brief bzero while tagging destination area, without allocating the zero'ed data in caches
+ * 
+ * @param ptr Tagged pointer to area that gets zero'ed out and tagged
+ * @param size Size of the area to zero out
+ * @note ptr must be aligned to tag boundary
+ * @note size must be aligned to tag boundary
+ * @note Meant for areas much larger than the last level cache: use memoryTagAndZero for areas that will be used soon.
+ */
+MTELIBEXPORT void memoryTagAndZeroStreaming(void* ptr, size_t size) {
+    VERIFY_ALIGNMENT_CRITICAL(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    MTE_STATS_BEGIN();
+    void* const end = ((char*)ptr + size);
+    void* const blocksEnd = ((char*)ptr + (size & ~(size_t)(COPY_BLOCK_SIZE - 1)));
+
+    //Tag-only stores, followed by non-temporal data stores for the same block.
+    //Tags must be stored before data, or the data stores would fail their tag check.
+    while (ptr < blocksEnd) {
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+        MTE_ASM("ST2G %0, [%0]\n\t"
+                "ST2G %0, [%0, #32]\n\t"
+                "STNP xzr, xzr, [%0]\n\t"
+                "STNP xzr, xzr, [%0, #16]\n\t"
+                "STNP xzr, xzr, [%0, #32]\n\t"
+                "STNP xzr, xzr, [%0, #48]\n\t"
+                "ADD %0, %0, #64"
+            : "+r"(ptr) :: "memory");
+  #else
+        MTE_ASM("STG %0, [%0]\n\t"
+                "STG %0, [%0, #16]\n\t"
+                "STG %0, [%0, #32]\n\t"
+                "STG %0, [%0, #48]\n\t"
+                "STNP xzr, xzr, [%0]\n\t"
+                "STNP xzr, xzr, [%0, #16]\n\t"
+                "STNP xzr, xzr, [%0, #32]\n\t"
+                "STNP xzr, xzr, [%0, #48]\n\t"
+                "ADD %0, %0, #64"
+            : "+r"(ptr) :: "memory");
+  #endif
     }
+    memoryTagAndZeroLoop(ptr, end);
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_ZERO, size, MTE_STATS_LOOP_KERNEL(size));
+#else
+    memoryTagAndZero(ptr, size);
 #endif
 }
 
@@ -212,21 +912,65 @@ MTELIBEXPORT void memoryTagAndZero(void* ptr, size_t size) {
  * @param size Size of the copy
  * @note dst must be aligned to tag boundary
  * @note size must be aligned to tag boundary
+ * @note Copies are done COPY_BLOCK_SIZE bytes at a time, and the source of copies of at least
+ *       MTELIB_COPY_PREFETCH_THRESHOLD bytes is prefetched.
+ * @note Tag checks are suppressed during the copy: the tag of src doesn't need to match the source's memory.
  */
 MTELIBEXPORT void memoryTagAndCopy(void* dst, const void* src, size_t size) {
     //Same as above, STGP aborts if pointer is not aligned to tag granule size.
 	VERIFY_ALIGNMENT_CRITICAL(dst, GRANULE_ALIGNMENT_MASK);
 	VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+    MTE_STATS_BEGIN();
 
 #ifndef MTELIB_NO_INLINE_ASSEMBLY
     void* const end = ((char*)dst + size);
+    void* const blocksEnd = ((char*)dst + (size & ~(size_t)(COPY_BLOCK_SIZE - 1)));
+    const int prefetch = (size >= MTELIB_COPY_PREFETCH_THRESHOLD);
+    const uint64_t tco = tagChecksSuppress();
 
-	//STGP only works on a single granule (no ST2GP), so we'll do granule by granule
+    //Keep 4 granules in flight: all loads are issued before the first store.
+    while (dst < blocksEnd) {
+        if (prefetch) {
+            MTE_ASM("PRFM PLDL1STRM, [%0]" :: "r"((const char*)src + MTELIB_COPY_PREFETCH_DISTANCE));
+        }
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+        MTE_ASM("LDP q0, q1, [%[src]]\n\t"
+                "LDP q2, q3, [%[src], #32]\n\t"
+                "ST2G %[dst], [%[dst]]\n\t"
+                "ST2G %[dst], [%[dst], #32]\n\t"
+                "STP q0, q1, [%[dst]]\n\t"
+                "STP q2, q3, [%[dst], #32]\n\t"
+                "ADD %[src], %[src], #64\n\t"
+                "ADD %[dst], %[dst], #64"
+            : [src]"+r"(src), [dst]"+r"(dst) :: "v0", "v1", "v2", "v3", "memory");
+  #else
+        uint64_t d0, d1, d2, d3, d4, d5, d6, d7;
+        MTE_ASM("LDP %0, %1, [%8]\n\t"
+                "LDP %2, %3, [%8, #16]\n\t"
+                "LDP %4, %5, [%8, #32]\n\t"
+                "LDP %6, %7, [%8, #48]\n\t"
+                "ADD %8, %8, #64"
+            : "=&r"(d0), "=&r"(d1), "=&r"(d2), "=&r"(d3), "=&r"(d4), "=&r"(d5), "=&r"(d6), "=&r"(d7), "+r"(src) :: "memory");
+        MTE_ASM("STGP %1, %2, [%0], #16\n\t"
+                "STGP %3, %4, [%0], #16\n\t"
+                "STGP %5, %6, [%0], #16\n\t"
+                "STGP %7, %8, [%0], #16"
+            : "+r"(dst) : "r"(d0), "r"(d1), "r"(d2), "r"(d3), "r"(d4), "r"(d5), "r"(d6), "r"(d7) : "memory");
+  #endif
+    }
+
+	//STGP only works on a single granule (no ST2GP), so we'll do the remaining granules one by one
 	while (dst < end) {
 		uint64_t low, high;
 		MTE_ASM("LDP %0, %1, [%2], #16" : "=r"(low), "=r"(high), "+r"(src));
 		MTE_ASM("STGP %[lo], %[hi], [%[ptr]], #16" : [ptr]"+r"(dst) : [lo]"r"(low), [hi]"r"(high) : "memory");
 	}
+    tagChecksRestore(tco);
+  #ifndef MTELIB_DISABLE_DGRANULE_OPERATIONS
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_COPY, size, (size >= COPY_BLOCK_SIZE) ? MTE_STATS_KERNEL_ST2G : MTE_STATS_KERNEL_STGP);
+  #else
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_COPY, size, MTE_STATS_KERNEL_STGP);
+  #endif
 #else
     uint64_t* in = (uint64_t*)src;
     uint64_t* out = (uint64_t*)dst;
@@ -237,5 +981,149 @@ MTELIBEXPORT void memoryTagAndCopy(void* dst, const void* src, size_t size) {
         out[1] = in[1];
         out += 2; in += 2; 
     }
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_COPY, size, MTE_STATS_KERNEL_STG);
 #endif
-}
\ No newline at end of file
+}
+
+//Store the tag and data of a single granule.
+MTELIBINTERNAL void memoryTagGranuleWithData(void* ptr, uint64_t low, uint64_t high) {
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    MTE_ASM("STGP %[lo], %[hi], [%[ptr]]" :: [ptr]"r"(ptr), [lo]"r"(low), [hi]"r"(high) : "memory");
+#else
+    __arm_mte_set_tag(ptr);
+    ((uint64_t*)ptr)[0] = low;
+    ((uint64_t*)ptr)[1] = high;
+#endif
+}
+
+/**
+ * @brief Initialize an area of memory while tagging it, data and tag of each granule being stored together
+ * 
+ * @param dst Tagged pointer to area that gets initialized and tagged
+ * @param size Size of the area
+ * @param init Data the area starts with (e.g. an object header), may be NULL if initSize is 0
+ * @param initSize Size of init, at most size (needn't be aligned to tag boundary)
+ * @param pattern Value the 8-byte words of the rest of the area are set to
+ * @note dst must be aligned to tag boundary
+ * @note size must be aligned to tag boundary
+ * @note Every granule is written once, using STGP: the granule following init is completed with pattern.
+ */
+MTELIBEXPORT void memoryTagAndInit(void* dst, size_t size, const void* init, size_t initSize, uint64_t pattern) {
+    //STGP aborts if pointer is not aligned to tag granule size.
+    VERIFY_ALIGNMENT_CRITICAL(dst, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+    MTE_ASSERT(initSize <= size, "Initial data larger than area");
+    MTE_STATS_BEGIN();
+
+    char* out = (char*)dst;
+    char* const end = out + size;
+    const char* in = (const char*)init;
+    char* const initEnd = out + (initSize & ~(size_t)GRANULE_ALIGNMENT_MASK);
+    for (; out < initEnd; out += GRANULE_SIZE, in += GRANULE_SIZE) {
+        uint64_t data[2];
+        memcpy(data, in, sizeof(data));
+        memoryTagGranuleWithData(out, data[0], data[1]);
+    }
+    if ((initSize & GRANULE_ALIGNMENT_MASK) != 0) {
+        uint64_t data[2] = { pattern, pattern };
+        memcpy(data, in, initSize & GRANULE_ALIGNMENT_MASK);
+        memoryTagGranuleWithData(out, data[0], data[1]);
+        out += GRANULE_SIZE;
+    }
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    for (; (size_t)(end - out) >= COPY_BLOCK_SIZE; ) {
+        MTE_ASM("STGP %[pattern], %[pattern], [%[out]], #16\n\t"
+                "STGP %[pattern], %[pattern], [%[out]], #16\n\t"
+                "STGP %[pattern], %[pattern], [%[out]], #16\n\t"
+                "STGP %[pattern], %[pattern], [%[out]], #16"
+            : [out]"+r"(out) : [pattern]"r"(pattern) : "memory");
+    }
+#endif
+    for (; out < end; out += GRANULE_SIZE) {
+        memoryTagGranuleWithData(out, pattern, pattern);
+    }
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_INIT, size, MTE_STATS_KERNEL_STGP);
+#else
+    MTE_STATS_END(MTE_STATS_OP_TAG_AND_INIT, size, MTE_STATS_KERNEL_STG);
+#endif
+}
+
+/**
+ * @brief Fill an area of memory with a pattern while tagging it
+ * 
+ * @param dst Tagged pointer to area that gets filled and tagged
+ * @param size Size of the area
+ * @param pattern Value the 8-byte words of the area are set to
+ * @note dst must be aligned to tag boundary
+ * @note size must be aligned to tag boundary
+ */
+MTELIBEXPORT void memoryTagAndFill(void* dst, size_t size, uint64_t pattern) {
+    memoryTagAndInit(dst, size, NULL, 0, pattern);
+}
+
+/**
+ * @brief memmove that carries the allocation tag of each source granule over to the destination
+ * 
+ * @param dst Pointer to destination (its tag is ignored)
+ * @param src Pointer to source (its tag is ignored)
+ * @param size Size of the copy
+ * @param remap Table giving the destination tag for each source tag, or NULL to keep tags as-is
+ * @note dst and src must be aligned to tag boundary
+ * @note size must be aligned to tag boundary
+ * @note Source and destination may overlap.
+ * @note If MTELIB_PRIVILEGED is set, source tags are read one LDGM block at a time.
+ */
+MTELIBEXPORT void memoryCopyWithTags(void* dst, const void* src, size_t size, const uint8_t remap[MAX_TAG + 1]) {
+    VERIFY_ALIGNMENT_CRITICAL(dst, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT_CRITICAL(src, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+
+    const size_t numGranules = size >> LOG2_TAG_GRANULE_SIZE;
+    //Copy backwards if the destination overlaps the end of the source, so that no granule is read after being written.
+    const int backwards = ((uintptr_t)pointerSetTag(dst, 0) > (uintptr_t)pointerSetTag((void*)src, 0));
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && defined(MTELIB_PRIVILEGED)
+    const uintptr_t blockMask = ~(uintptr_t)(memoryGetGMBlockSize() - 1);
+    uintptr_t blockBase = 0;
+    uint64_t blockTags = 0;
+#endif
+
+    //Pointers are given the tags just read, checking them again would only cost time.
+    const uint64_t tco = tagChecksSuppress();
+    for (size_t i = 0; i < numGranules; i++) {
+        const size_t granule = backwards ? (numGranules - 1 - i) : i;
+        const char* in = (const char*)src + (granule << LOG2_TAG_GRANULE_SIZE);
+        char* out = (char*)dst + (granule << LOG2_TAG_GRANULE_SIZE);
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && defined(MTELIB_PRIVILEGED)
+        //Only granules that were already read get overwritten, so cached block tags stay valid.
+        if (i == 0 || ((uintptr_t)in & blockMask) != blockBase) {
+            blockBase = (uintptr_t)in & blockMask;
+            MTE_ASM("LDGM %0, [%1]" : "=r"(blockTags) : "r"(in));
+        }
+        const uint64_t tag = (blockTags >> ((((uintptr_t)in >> LOG2_TAG_GRANULE_SIZE) & 0xF) * 4)) & MAX_TAG;
+#else
+        const uint64_t tag = memoryGetTag(in);
+#endif
+        in = (const char*)pointerSetTag((void*)in, tag);
+        out = (char*)pointerSetTag(out, (remap != NULL) ? remap[tag] : tag);
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+        uint64_t low, high;
+        MTE_ASM("LDP %0, %1, [%2]" : "=r"(low), "=r"(high) : "r"(in) : "memory");
+        MTE_ASM("STGP %[lo], %[hi], [%[ptr]]" :: [ptr]"r"(out), [lo]"r"(low), [hi]"r"(high) : "memory");
+#else
+        const uint64_t low = ((const uint64_t*)in)[0];
+        const uint64_t high = ((const uint64_t*)in)[1];
+        __arm_mte_set_tag(out);
+        ((uint64_t*)out)[0] = low;
+        ((uint64_t*)out)[1] = high;
+#endif
+    }
+    tagChecksRestore(tco);
+}
+
+#endif //MTELIB_H
@@ -0,0 +1,329 @@
+/**
+ * @file mtelib.hpp
+ * @author CreepNT
+ * @brief C++ front-end for mtelib.h, with compile-time size specialization
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Tagging functions of this file are fully unrolled into straight STG/ST2G/STZG/STZ2G sequences.
+ *       Size constraints are enforced using static_assert, and no runtime alignment check is done.
+ */
+
+#ifndef MTELIB_HPP
+#define MTELIB_HPP
+
+#include "mtelib.h"
+#include "mtelib_mode.h"
+
+#include <cstddef> //std::size_t, std::ptrdiff_t
+#include <cstdint> //uint64_t
+#include <type_traits> //std::enable_if_t, std::is_trivially_copyable, std::is_void
+#include <utility> //std::index_sequence
+
+/* Configuration options */
+//MTELIB_UNROLL_LIMIT: largest size (in bytes) for which tagging is unrolled, larger sizes use mtelib.h's loops.
+
+#ifndef MTELIB_UNROLL_LIMIT
+    #define MTELIB_UNROLL_LIMIT (512U)
+#endif
+
+//Immediate offsets of STG/ST2G/STZG/STZ2G range from -4096 to 4080.
+static_assert(MTELIB_UNROLL_LIMIT <= 4096, "Unroll limit too large for immediate offsets");
+
+namespace mte {
+
+namespace detail {
+
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+template <std::size_t Offset>
+inline void stg(void* ptr) {
+    MTE_ASM("STG %0, [%0, #%c1]" :: "r"(ptr), "i"(Offset) : "memory");
+}
+
+template <std::size_t Offset>
+inline void st2g(void* ptr) {
+    MTE_ASM("ST2G %0, [%0, #%c1]" :: "r"(ptr), "i"(Offset) : "memory");
+}
+
+template <std::size_t Offset>
+inline void stzg(void* ptr) {
+    MTE_ASM("STZG %0, [%0, #%c1]" :: "r"(ptr), "i"(Offset) : "memory");
+}
+
+template <std::size_t Offset>
+inline void stz2g(void* ptr) {
+    MTE_ASM("STZ2G %0, [%0, #%c1]" :: "r"(ptr), "i"(Offset) : "memory");
+}
+#else
+template <std::size_t Offset>
+inline void stg(void* ptr) {
+    __arm_mte_set_tag((char*)ptr + Offset);
+}
+
+template <std::size_t Offset>
+inline void stzg(void* ptr) {
+    uint64_t* const out = (uint64_t*)((char*)ptr + Offset);
+    __arm_mte_set_tag(out);
+    out[0] = 0;
+    out[1] = 0;
+}
+#endif
+
+template <std::size_t Size, bool Zero, std::size_t... Granules>
+inline void tagGranules(void* ptr, std::index_sequence<Granules...>) {
+    if constexpr (Zero) {
+        (stzg<Granules * GRANULE_SIZE>(ptr), ...);
+    } else {
+        (stg<Granules * GRANULE_SIZE>(ptr), ...);
+    }
+}
+
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_DGRANULE_OPERATIONS)
+template <std::size_t Size, bool Zero, std::size_t... DGranules>
+inline void tagDGranules(void* ptr, std::index_sequence<DGranules...>) {
+    if constexpr (Zero) {
+        (stz2g<DGranules * DGRANULE_SIZE>(ptr), ...);
+    } else {
+        (st2g<DGranules * DGRANULE_SIZE>(ptr), ...);
+    }
+}
+#endif
+
+template <std::size_t Size, bool Zero>
+inline void tagUnrolled(void* ptr) {
+    static_assert((Size & GRANULE_ALIGNMENT_MASK) == 0, "Size must be aligned to tag boundary");
+
+    if constexpr (Size > MTELIB_UNROLL_LIMIT) {
+        if constexpr (Zero) {
+            memoryTagAndZero(ptr, Size);
+        } else {
+            memoryTag(ptr, Size);
+        }
+    } else {
+#if !defined(MTELIB_NO_INLINE_ASSEMBLY) && !defined(MTELIB_DISABLE_DGRANULE_OPERATIONS)
+        tagDGranules<Size, Zero>(ptr, std::make_index_sequence<Size / DGRANULE_SIZE>{});
+        if constexpr ((Size & DGRANULE_ALIGNMENT_MASK) != 0) {
+            if constexpr (Zero) {
+                stzg<Size - GRANULE_SIZE>(ptr);
+            } else {
+                stg<Size - GRANULE_SIZE>(ptr);
+            }
+        }
+#else
+        tagGranules<Size, Zero>(ptr, std::make_index_sequence<Size / GRANULE_SIZE>{});
+#endif
+    }
+}
+
+} //namespace detail
+
+/**
+ * @brief Tag an area of memory of a compile-time size
+ *
+ * @tparam Size Size of the area to tag (must be aligned to tag boundary)
+ * @param ptr Tagged pointer to area that gets tagged with the tag in ptr itself
+ * @note ptr must be aligned to tag boundary, this isn't checked.
+ */
+template <std::size_t Size>
+inline void tag(void* ptr) {
+    detail::tagUnrolled<Size, false>(ptr);
+}
+
+/**
+ * @brief Tag an object
+ *
+ * @tparam T Type of the object (must be aligned to tag boundary)
+ * @param ptr Tagged pointer to object that gets tagged with the tag in ptr itself
+ */
+template <typename T>
+inline void tag(T* ptr) {
+    static_assert(alignof(T) >= GRANULE_SIZE, "Type must be aligned to tag boundary");
+    detail::tagUnrolled<sizeof(T), false>(ptr);
+}
+
+/**
+ * @brief bzero while tagging an area of memory of a compile-time size
+ *
+ * @tparam Size Size of the area to zero out (must be aligned to tag boundary)
+ * @param ptr Tagged pointer to area that gets zero'ed out and tagged
+ * @note ptr must be aligned to tag boundary, this isn't checked.
+ */
+template <std::size_t Size>
+inline void tagAndZero(void* ptr) {
+    detail::tagUnrolled<Size, true>(ptr);
+}
+
+/**
+ * @brief bzero while tagging an object
+ *
+ * @tparam T Type of the object (must be aligned to tag boundary)
+ * @param ptr Tagged pointer to object that gets zero'ed out and tagged
+ */
+template <typename T>
+inline void tagAndZero(T* ptr) {
+    static_assert(alignof(T) >= GRANULE_SIZE, "Type must be aligned to tag boundary");
+    detail::tagUnrolled<sizeof(T), true>(ptr);
+}
+
+/**
+ * @brief Copy an object into memory while tagging it, data and tags being stored together (see memoryTagAndInit)
+ *
+ * @tparam T Type of the object (must be aligned to tag boundary and trivially copyable)
+ * @param ptr Tagged pointer to memory receiving the object
+ * @param value Object to copy
+ * @return ptr, as a pointer to the object
+ */
+template <typename T>
+inline T* tagAndInit(void* ptr, const T& value) {
+    static_assert(alignof(T) >= GRANULE_SIZE, "Type must be aligned to tag boundary");
+    static_assert(std::is_trivially_copyable<T>::value, "Type must be trivially copyable");
+    memoryTagAndInit(ptr, sizeof(T), &value, sizeof(T), 0);
+    return static_cast<T*>(ptr);
+}
+
+/**
+ * @brief Pointer holding an MTE tag in its top byte
+ *
+ * @tparam T Type of the pointed-to object
+ * @note Arithmetic on the pointer (operator+, operator-, ...) never modifies the tag.
+ * @note Comparisons only consider addresses, tags are ignored.
+ */
+template <typename T>
+class tagged_ptr {
+public:
+    constexpr tagged_ptr() noexcept : ptr_(nullptr) {}
+    constexpr tagged_ptr(std::nullptr_t) noexcept : ptr_(nullptr) {}
+    explicit tagged_ptr(T* ptr) noexcept : ptr_(ptr) {}
+
+    T* get() const noexcept { return ptr_; }
+    T* operator->() const noexcept { return ptr_; }
+
+    //Templates, so that tagged_ptr<void> (e.g. wrapping taggedArenaAlloc results) can be instantiated without them.
+    template <typename U = T, typename = std::enable_if_t<!std::is_void<U>::value>>
+    U& operator*() const noexcept { return *ptr_; }
+    template <typename U = T, typename = std::enable_if_t<!std::is_void<U>::value>>
+    U& operator[](std::ptrdiff_t i) const noexcept { return ptr_[i]; }
+    explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+    uint64_t tag() const noexcept { return pointerGetTag((void*)ptr_); }
+    tagged_ptr withTag(uint64_t tag) const noexcept { return tagged_ptr((T*)pointerSetTag((void*)ptr_, tag)); }
+    tagged_ptr withRandomTag(ExcludeMask excluded = 0) const noexcept { return tagged_ptr((T*)pointerSetRandomTag((void*)ptr_, excluded)); }
+
+    /**
+     * @brief Offset the pointer and its tag in a single ADDG
+     *
+     * @tparam ByteOffset Offset added to the address (multiple of GRANULE_SIZE, at most 1008)
+     * @tparam TagOffset Offset added to the tag (at most 15)
+     * @note Tags excluded by GCR_EL1 are skipped when offsetting the tag.
+     */
+    template <std::size_t ByteOffset, unsigned TagOffset = 1>
+    tagged_ptr addg() const noexcept {
+        static_assert((ByteOffset & GRANULE_ALIGNMENT_MASK) == 0 && ByteOffset <= 1008, "Invalid ADDG byte offset");
+        static_assert(TagOffset <= MAX_TAG, "Invalid ADDG tag offset");
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+        T* result;
+        MTE_ASM("ADDG %0, %1, #%c2, #%c3" : "=r"(result) : "r"(ptr_), "i"(ByteOffset), "i"(TagOffset));
+        return tagged_ptr(result);
+#else
+        return tagged_ptr((T*)((char*)__arm_mte_increment_tag(ptr_, TagOffset) + ByteOffset));
+#endif
+    }
+
+    /**
+     * @brief Subtract an offset from the pointer and offset its tag in a single SUBG
+     *
+     * @tparam ByteOffset Offset subtracted from the address (multiple of GRANULE_SIZE, at most 1008)
+     * @tparam TagOffset Offset added to the tag (at most 15)
+     * @note Tags excluded by GCR_EL1 are skipped when offsetting the tag.
+     */
+    template <std::size_t ByteOffset, unsigned TagOffset = 1>
+    tagged_ptr subg() const noexcept {
+        static_assert((ByteOffset & GRANULE_ALIGNMENT_MASK) == 0 && ByteOffset <= 1008, "Invalid SUBG byte offset");
+        static_assert(TagOffset <= MAX_TAG, "Invalid SUBG tag offset");
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+        T* result;
+        MTE_ASM("SUBG %0, %1, #%c2, #%c3" : "=r"(result) : "r"(ptr_), "i"(ByteOffset), "i"(TagOffset));
+        return tagged_ptr(result);
+#else
+        return tagged_ptr((T*)((char*)__arm_mte_increment_tag(ptr_, TagOffset) - ByteOffset));
+#endif
+    }
+
+    /**
+     * @brief Difference between addresses in bytes, ignoring tags (SUBP)
+     */
+    template <typename U>
+    std::ptrdiff_t byteDistance(const tagged_ptr<U>& other) const noexcept {
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+        std::ptrdiff_t diff;
+        MTE_ASM("SUBP %0, %1, %2" : "=r"(diff) : "r"(ptr_), "r"(other.get()));
+        return diff;
+#else
+        return __arm_mte_ptrdiff(ptr_, other.get());
+#endif
+    }
+
+    std::ptrdiff_t operator-(const tagged_ptr& other) const noexcept { return byteDistance(other) / (std::ptrdiff_t)sizeof(T); }
+
+    //The addition can't carry into the tag: user space addresses are below 2^56.
+    tagged_ptr operator+(std::ptrdiff_t n) const noexcept { return tagged_ptr(ptr_ + n); }
+    tagged_ptr operator-(std::ptrdiff_t n) const noexcept { return tagged_ptr(ptr_ - n); }
+    tagged_ptr& operator+=(std::ptrdiff_t n) noexcept { ptr_ += n; return *this; }
+    tagged_ptr& operator-=(std::ptrdiff_t n) noexcept { ptr_ -= n; return *this; }
+    tagged_ptr& operator++() noexcept { ++ptr_; return *this; }
+    tagged_ptr& operator--() noexcept { --ptr_; return *this; }
+    tagged_ptr operator++(int) noexcept { tagged_ptr old = *this; ++ptr_; return old; }
+    tagged_ptr operator--(int) noexcept { tagged_ptr old = *this; --ptr_; return old; }
+
+    bool operator==(const tagged_ptr& other) const noexcept { return byteDistance(other) == 0; }
+    bool operator!=(const tagged_ptr& other) const noexcept { return byteDistance(other) != 0; }
+    bool operator<(const tagged_ptr& other) const noexcept { return byteDistance(other) < 0; }
+    bool operator<=(const tagged_ptr& other) const noexcept { return byteDistance(other) <= 0; }
+    bool operator>(const tagged_ptr& other) const noexcept { return byteDistance(other) > 0; }
+    bool operator>=(const tagged_ptr& other) const noexcept { return byteDistance(other) >= 0; }
+
+    bool sameTag(const tagged_ptr& other) const noexcept { return tag() == other.tag(); }
+
+private:
+    T* ptr_;
+};
+
+/**
+ * @brief Suppresses tag checks of the calling thread (PSTATE.TCO) for the lifetime of the guard
+ *
+ * @note Compiled away if MTELIB_NO_INLINE_ASSEMBLY is set: tag checks then stay enabled.
+ */
+class unchecked_scope {
+public:
+    unchecked_scope() noexcept : previous_(tagChecksSuppress()) {}
+    ~unchecked_scope() { tagChecksRestore(previous_); }
+
+    unchecked_scope(const unchecked_scope&) = delete;
+    unchecked_scope& operator=(const unchecked_scope&) = delete;
+
+private:
+    uint64_t previous_;
+};
+
+/**
+ * @brief Switches the calling thread to another tag check fault mode for the lifetime of the guard
+ *
+ * @note If switching fails, the thread keeps its mode and ok() returns false.
+ */
+class mode_guard {
+public:
+    explicit mode_guard(MTEMode mode) noexcept : ok_(mteModeScopeEnter(&scope_, mode) == 0) {}
+    ~mode_guard() { mteModeScopeExit(&scope_); }
+
+    mode_guard(const mode_guard&) = delete;
+    mode_guard& operator=(const mode_guard&) = delete;
+
+    bool ok() const noexcept { return ok_; }
+
+private:
+    MTEModeScope scope_;
+    bool ok_;
+};
+
+} //namespace mte
+
+#endif //MTELIB_HPP
@@ -0,0 +1,592 @@
+/**
+ * @file mtelib_arena.h
+ * @author CreepNT
+ * @brief Tagged memory arena with per-size-class free lists, built on mtelib.h
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note The arena is not thread-safe.
+ */
+
+#ifndef MTELIB_ARENA_H
+#define MTELIB_ARENA_H
+
+#include "mtelib.h"
+
+#include <stddef.h> //size_t
+#include <stdint.h> //uint8_t, uintptr_t
+#include <string.h> //memcpy, memset
+
+#include <sys/mman.h>
+
+#ifndef PROT_MTE
+    #define PROT_MTE (0x20)
+#endif
+
+/* Configuration options */
+//TAGGED_ARENA_LOG2_SLAB_SIZE: log2 of the size of slabs carved out of the arena for a single size class.
+//TAGGED_ARENA_MAX_SIZE: largest allocation served by the arena (must be a multiple of GRANULE_SIZE).
+//TAGGED_ARENA_TRACK_CHUNKS: record the requested size and allocation site of each chunk, for fault attribution.
+
+#ifndef TAGGED_ARENA_LOG2_SLAB_SIZE
+    #define TAGGED_ARENA_LOG2_SLAB_SIZE (16U)
+#endif
+
+#ifndef TAGGED_ARENA_MAX_SIZE
+    #define TAGGED_ARENA_MAX_SIZE (512U)
+#endif
+
+#define TAGGED_ARENA_SLAB_SIZE   ((size_t)1U << TAGGED_ARENA_LOG2_SLAB_SIZE)
+#define TAGGED_ARENA_NUM_CLASSES (TAGGED_ARENA_MAX_SIZE / GRANULE_SIZE)
+#define TAGGED_ARENA_NO_CLASS    (0xFFU)
+#define TAGGED_ARENA_SLAB_CHUNKS (TAGGED_ARENA_SLAB_SIZE >> LOG2_TAG_GRANULE_SIZE) //Most chunks a slab can hold
+
+//Tag given to memory that doesn't belong to any live chunk.
+#define TAGGED_ARENA_FREE_TAG    (0ULL)
+
+static_assert((TAGGED_ARENA_MAX_SIZE & GRANULE_ALIGNMENT_MASK) == 0, "Arena max size must be granule-aligned");
+static_assert(TAGGED_ARENA_NUM_CLASSES < TAGGED_ARENA_NO_CLASS, "Too many arena size classes");
+static_assert(TAGGED_ARENA_SLAB_SIZE >= TAGGED_ARENA_MAX_SIZE, "Arena slabs too small for largest size class");
+
+typedef enum TaggedArenaRetagMode {
+    TAGGED_ARENA_RETAG_ON_FREE  = 0, //Retag (and zero) chunks when they are freed
+    TAGGED_ARENA_RETAG_ON_ALLOC = 1, //Retag (and zero) chunks when they are handed out again
+    TAGGED_ARENA_RETAG_AUTO     = 2, //Pick one of the above, depending on how often freed chunks get reused
+} TaggedArenaRetagMode;
+
+#define TAGGED_ARENA_NUM_RETAG_MODES (2U) //TAGGED_ARENA_RETAG_AUTO always resolves to one of the other modes
+
+typedef struct TaggedArenaRetagStats {
+    uint64_t retags;          //Chunks retagged
+    uint64_t granulesTagged;  //Granules whose tag was stored
+    uint64_t granulesAvoided; //Granules of freed chunks that never needed to be retagged
+} TaggedArenaRetagStats;
+
+//Free chunks hold a tagged pointer to the next free chunk of the same size class.
+typedef struct TaggedArenaFreeChunk {
+    struct TaggedArenaFreeChunk* next;
+} TaggedArenaFreeChunk;
+
+//Only kept if TAGGED_ARENA_TRACK_CHUNKS is set. Entries are written with plain stores, so that signal handlers can read them.
+typedef struct TaggedArenaChunkInfo {
+    const void* site;       //Allocation site given to taggedArenaAllocFrom
+    uint32_t size;          //Requested size
+    uint32_t live;          //Whether the chunk is currently allocated
+} TaggedArenaChunkInfo;
+
+typedef struct TaggedArenaClass {
+    TaggedArenaFreeChunk* freeList; //Tagged pointers, tag matches memory, chunks already retagged and zero'ed
+    TaggedArenaFreeChunk* staleList;//Tagged pointers, tag matches memory, chunks still carry their old tag and data
+    TaggedArenaFreeChunk* untaggedList;//Chunks of unsampled allocations, tagged with TAGGED_ARENA_FREE_TAG and zero'ed
+    uint64_t staleCount;            //Number of chunks in staleList
+    uint64_t frees;                 //Chunks freed
+    uint64_t reuses;                //Allocations served from freeList or staleList
+    char* bump;                     //Untagged, next never-used chunk in the current slab
+    char* bumpEnd;                  //Untagged, end of the current slab
+} TaggedArenaClass;
+
+typedef struct TaggedArena {
+    char* base;             //Untagged base of the PROT_MTE reservation
+    size_t size;            //Size of the reservation
+    size_t used;            //Bytes of the reservation handed out to size classes
+    ExcludeMask excluded;   //Tags never given to chunks (always contains TAGGED_ARENA_FREE_TAG)
+    uint8_t* slabClasses;   //Size class of each slab, or TAGGED_ARENA_NO_CLASS
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    TaggedArenaChunkInfo* chunkInfo; //TAGGED_ARENA_SLAB_CHUNKS entries per slab, indexed by chunk
+#endif
+    TaggedArenaClass classes[TAGGED_ARENA_NUM_CLASSES];
+    uint8_t retagModes[TAGGED_ARENA_NUM_CLASSES];
+    uint8_t alwaysSampled[TAGGED_ARENA_NUM_CLASSES]; //Size classes tagged regardless of sampleRate
+    uint32_t sampleRate;    //1 in sampleRate allocations get a random tag (1: all of them, 0: none)
+    uint32_t sampleCountdown; //Allocations left before the next sampled one, reloaded from sampleRate when 0
+    TaggedArenaRetagStats retagStats[TAGGED_ARENA_NUM_RETAG_MODES];
+} TaggedArena;
+
+MTELIBINTERNAL size_t taggedArenaClassIndex(size_t size) {
+    return (size <= GRANULE_SIZE) ? 0 : ((size - 1) >> LOG2_TAG_GRANULE_SIZE);
+}
+
+MTELIBINTERNAL size_t taggedArenaClassSize(size_t classIndex) {
+    return (classIndex + 1) << LOG2_TAG_GRANULE_SIZE;
+}
+
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+MTELIBINTERNAL size_t taggedArenaChunkInfoSize(size_t arenaSize) {
+    return (arenaSize >> TAGGED_ARENA_LOG2_SLAB_SIZE) * TAGGED_ARENA_SLAB_CHUNKS * sizeof(TaggedArenaChunkInfo);
+}
+#endif
+
+/**
+ * @brief Get the tracking entry of the chunk containing an offset of the arena
+ *
+ * @param arena Arena to query
+ * @param offset Offset from the arena's base, in a slab belonging to a size class
+ * @param classSize Size of the slab's size class
+ * @return Tracking entry, or NULL if TAGGED_ARENA_TRACK_CHUNKS isn't set
+ * @note Async-signal-safe.
+ */
+MTELIBEXPORT TaggedArenaChunkInfo* taggedArenaGetChunkInfo(const TaggedArena* arena, size_t offset, size_t classSize) {
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    const size_t slab = offset >> TAGGED_ARENA_LOG2_SLAB_SIZE;
+    const size_t chunk = (offset & (TAGGED_ARENA_SLAB_SIZE - 1)) / classSize;
+    return &arena->chunkInfo[slab * TAGGED_ARENA_SLAB_CHUNKS + chunk];
+#else
+    (void)arena; (void)offset; (void)classSize;
+    return NULL;
+#endif
+}
+
+MTELIBINTERNAL TaggedArenaRetagMode taggedArenaResolveRetagMode(const TaggedArena* arena, size_t classIndex) {
+    const TaggedArenaRetagMode mode = (TaggedArenaRetagMode)arena->retagModes[classIndex];
+    if (mode != TAGGED_ARENA_RETAG_AUTO) {
+        return mode;
+    }
+
+    //If most freed chunks are never handed out again, deferring the retag avoids their tag stores entirely.
+    //Otherwise both modes store the same amount of tags, so prefer retagging on free which catches use-after-free.
+    const TaggedArenaClass* const sc = &arena->classes[classIndex];
+    return (sc->reuses * 2 < sc->frees) ? TAGGED_ARENA_RETAG_ON_ALLOC : TAGGED_ARENA_RETAG_ON_FREE;
+}
+
+//Add the memory tags of the granules right before and right after a chunk to an exclude mask, so that linear
+//overflows out of the chunk fault (those granules may belong to another slab, or to no chunk at all).
+MTELIBINTERNAL ExcludeMask taggedArenaExcludeNeighbours(const TaggedArena* arena, void* chunk, size_t classSize, ExcludeMask mask) {
+    char* const untagged = (char*)pointerSetTag(chunk, 0);
+    if (untagged > arena->base) {
+        mask = excludeMaskAddTag(mask, memoryGetTag(untagged - GRANULE_SIZE));
+    }
+    if (untagged + classSize < arena->base + arena->used) {
+        mask = excludeMaskAddTag(mask, memoryGetTag(untagged + classSize));
+    }
+    return mask;
+}
+
+//Chunks handed out are zero'ed, except for their first initSize bytes which are copied from init if it isn't NULL.
+MTELIBINTERNAL void* taggedArenaRetag(TaggedArena* arena, void* ptr, size_t classSize, TaggedArenaRetagMode mode, const void* init, size_t initSize) {
+    const ExcludeMask excluded = taggedArenaExcludeNeighbours(arena, ptr, classSize, excludeMaskAddPtrTag(arena->excluded, ptr));
+    void* const retagged = pointerSetTagFromSource(ptr, excluded);
+    if (init != NULL) {
+        memoryTagAndInit(retagged, classSize, init, initSize, 0);
+    } else {
+        memoryTagAndZero(retagged, classSize);
+    }
+
+    TaggedArenaRetagStats* const stats = &arena->retagStats[mode];
+    stats->retags++;
+    stats->granulesTagged += classSize >> LOG2_TAG_GRANULE_SIZE;
+    return retagged;
+}
+
+/**
+ * @brief Reserve a PROT_MTE mapping to be used as a tagged arena
+ *
+ * @param arena Arena to initialize
+ * @param size Size of the reservation (rounded up to slab size)
+ * @param excluded Tags that must never be given to chunks
+ * @return 0 on success, -1 on failure (errno is set by mmap)
+ * @note This is the only place where the arena calls mmap().
+ */
+MTELIBEXPORT int taggedArenaInit(TaggedArena* arena, size_t size, ExcludeMask excluded) {
+    size = (size + TAGGED_ARENA_SLAB_SIZE - 1) & ~(TAGGED_ARENA_SLAB_SIZE - 1);
+    memset(arena, 0, sizeof(*arena));
+
+    const size_t numSlabs = size >> TAGGED_ARENA_LOG2_SLAB_SIZE;
+    void* slabClasses = mmap(NULL, numSlabs, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slabClasses == MAP_FAILED) {
+        return -1;
+    }
+
+    void* base = mmap(NULL, size, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        munmap(slabClasses, numSlabs);
+        return -1;
+    }
+
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    //Only the entries of chunks actually carved out of slabs get touched.
+    void* chunkInfo = mmap(NULL, taggedArenaChunkInfoSize(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (chunkInfo == MAP_FAILED) {
+        munmap(base, size);
+        munmap(slabClasses, numSlabs);
+        return -1;
+    }
+    arena->chunkInfo = (TaggedArenaChunkInfo*)chunkInfo;
+#endif
+
+    memset(slabClasses, TAGGED_ARENA_NO_CLASS, numSlabs);
+    arena->base = (char*)base;
+    arena->size = size;
+    arena->excluded = excludeMaskAddTag(excluded, TAGGED_ARENA_FREE_TAG);
+    arena->slabClasses = (uint8_t*)slabClasses;
+    arena->sampleRate = 1;
+    return 0;
+}
+
+/**
+ * @brief Release the memory reserved by an arena
+ *
+ * @param arena Arena to destroy
+ * @note All pointers returned by the arena become invalid.
+ */
+MTELIBEXPORT void taggedArenaDestroy(TaggedArena* arena) {
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    munmap(arena->chunkInfo, taggedArenaChunkInfoSize(arena->size));
+#endif
+    munmap(arena->slabClasses, arena->size >> TAGGED_ARENA_LOG2_SLAB_SIZE);
+    munmap(arena->base, arena->size);
+    memset(arena, 0, sizeof(*arena));
+}
+
+//Make sure the bump area of a size class holds a chunk, carving a new slab if needed. Returns 0 if the arena is exhausted.
+MTELIBINTERNAL int taggedArenaRefillBump(TaggedArena* arena, TaggedArenaClass* sc, size_t classIndex) {
+    if ((size_t)(sc->bumpEnd - sc->bump) >= taggedArenaClassSize(classIndex)) {
+        return 1;
+    }
+    if (arena->size - arena->used < TAGGED_ARENA_SLAB_SIZE) {
+        return 0;
+    }
+    sc->bump = arena->base + arena->used;
+    sc->bumpEnd = sc->bump + TAGGED_ARENA_SLAB_SIZE;
+    arena->slabClasses[arena->used >> TAGGED_ARENA_LOG2_SLAB_SIZE] = (uint8_t)classIndex;
+    arena->used += TAGGED_ARENA_SLAB_SIZE;
+    return 1;
+}
+
+MTELIBINTERNAL void* taggedArenaAllocChunk(TaggedArena* arena, size_t size, const void* init, size_t initSize) {
+    const size_t classIndex = taggedArenaClassIndex(size);
+    TaggedArenaClass* const sc = &arena->classes[classIndex];
+
+    //Fast path: reuse a chunk that was retagged and zero'ed when freed.
+    TaggedArenaFreeChunk* chunk = sc->freeList;
+    if (chunk != NULL) {
+        sc->freeList = chunk->next;
+        sc->reuses++;
+        chunk->next = NULL;
+        if (init != NULL) {
+            memcpy(chunk, init, initSize);
+        }
+        return chunk;
+    }
+
+    const size_t classSize = taggedArenaClassSize(classIndex);
+    chunk = sc->staleList;
+    if (chunk != NULL) {
+        sc->staleList = chunk->next;
+        sc->staleCount--;
+        sc->reuses++;
+        return taggedArenaRetag(arena, chunk, classSize, TAGGED_ARENA_RETAG_ON_ALLOC, init, initSize);
+    }
+
+    if (!taggedArenaRefillBump(arena, sc, classIndex)) {
+        return NULL;
+    }
+
+    //Never-used chunks are already zero'ed, only their tag needs to be set.
+    void* ptr = pointerSetTagFromSource(sc->bump, taggedArenaExcludeNeighbours(arena, sc->bump, classSize, arena->excluded));
+    if (init != NULL) {
+        memoryTagAndInit(ptr, classSize, init, initSize, 0);
+    } else {
+        memoryTag(ptr, classSize);
+    }
+    sc->bump += classSize;
+    return ptr;
+}
+
+//Unsampled allocations keep TAGGED_ARENA_FREE_TAG, which memory of never-used chunks already has: no tag is stored.
+MTELIBINTERNAL void* taggedArenaAllocUntagged(TaggedArena* arena, size_t size, const void* init, size_t initSize) {
+    const size_t classIndex = taggedArenaClassIndex(size);
+    TaggedArenaClass* const sc = &arena->classes[classIndex];
+
+    TaggedArenaFreeChunk* const chunk = sc->untaggedList;
+    if (chunk != NULL) {
+        sc->untaggedList = chunk->next;
+        sc->reuses++;
+        chunk->next = NULL;
+        if (init != NULL) {
+            memcpy(chunk, init, initSize);
+        }
+        return chunk;
+    }
+
+    if (!taggedArenaRefillBump(arena, sc, classIndex)) {
+        //Chunks freed by sampled allocations are still usable, with a tag.
+        return taggedArenaAllocChunk(arena, size, init, initSize);
+    }
+    void* const ptr = sc->bump;
+    sc->bump += taggedArenaClassSize(classIndex);
+    if (init != NULL) {
+        memcpy(ptr, init, initSize);
+    }
+    return ptr;
+}
+
+//Sampling decision, a countdown of the arena.
+MTELIBINTERNAL int taggedArenaShouldSample(TaggedArena* arena, size_t classIndex) {
+    const uint32_t rate = arena->sampleRate;
+    if (rate == 1 || arena->alwaysSampled[classIndex]) {
+        return 1;
+    }
+    if (rate == 0) {
+        return 0;
+    }
+
+    const uint32_t remaining = (arena->sampleCountdown == 0) ? rate : arena->sampleCountdown;
+    arena->sampleCountdown = remaining - 1;
+    return remaining == 1;
+}
+
+MTELIBINTERNAL void* taggedArenaAllocWith(TaggedArena* arena, size_t size, const void* site, const void* init, size_t initSize) {
+    MTE_ASSERT(size <= TAGGED_ARENA_MAX_SIZE, "Allocation too large for arena");
+    MTE_ASSERT(initSize <= size, "Initial data larger than allocation");
+    void* const ptr = taggedArenaShouldSample(arena, taggedArenaClassIndex(size)) ?
+        taggedArenaAllocChunk(arena, size, init, initSize) : taggedArenaAllocUntagged(arena, size, init, initSize);
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    if (ptr != NULL) {
+        const size_t offset = (size_t)((char*)pointerSetTag(ptr, 0) - arena->base);
+        TaggedArenaChunkInfo* const info = taggedArenaGetChunkInfo(arena, offset, taggedArenaClassSize(taggedArenaClassIndex(size)));
+        info->site = site;
+        info->size = (uint32_t)size;
+        info->live = 1;
+    }
+#else
+    (void)site;
+#endif
+    return ptr;
+}
+
+/**
+ * @brief Allocate a zero'ed, tagged chunk from the arena, recording where it was allocated from
+ *
+ * @param arena Arena to allocate from
+ * @param size Size of the allocation (at most TAGGED_ARENA_MAX_SIZE)
+ * @param site Allocation site (e.g. __builtin_return_address(0)), reported if an access to the chunk faults
+ * @return Tagged pointer to a granule-aligned chunk, or NULL if the arena is exhausted
+ * @note Chunks never get the tag of the memory right before or after them (read using LDG when they are tagged), so
+ *       that linear overflows into neighbouring chunks fault, unless both are unsampled.
+ * @note Allocations left out by sampling (see taggedArenaSetSampleRate) are tagged with TAGGED_ARENA_FREE_TAG.
+ * @note site and size are only recorded if TAGGED_ARENA_TRACK_CHUNKS is set.
+ */
+MTELIBEXPORT void* taggedArenaAllocFrom(TaggedArena* arena, size_t size, const void* site) {
+    return taggedArenaAllocWith(arena, size, site, NULL, 0);
+}
+
+/**
+ * @brief Allocate a zero'ed, tagged chunk from the arena
+ *
+ * @param arena Arena to allocate from
+ * @param size Size of the allocation (at most TAGGED_ARENA_MAX_SIZE)
+ * @return Tagged pointer to a granule-aligned chunk, or NULL if the arena is exhausted
+ * @note Chunks never get the tag of the memory right before or after them (read using LDG when they are tagged), so
+ *       that linear overflows into neighbouring chunks fault, unless both are unsampled.
+ * @note Allocations left out by sampling (see taggedArenaSetSampleRate) are tagged with TAGGED_ARENA_FREE_TAG.
+ */
+MTELIBEXPORT void* taggedArenaAlloc(TaggedArena* arena, size_t size) {
+    return taggedArenaAllocWith(arena, size, NULL, NULL, 0);
+}
+
+/**
+ * @brief Allocate a tagged chunk from the arena, initialized with a copy of an object
+ *
+ * @param arena Arena to allocate from
+ * @param size Size of the allocation (at most TAGGED_ARENA_MAX_SIZE)
+ * @param init Data the chunk starts with (e.g. an object header)
+ * @param initSize Size of init, at most size
+ * @return Tagged pointer to a granule-aligned chunk, zero'ed past initSize, or NULL if the arena is exhausted
+ * @note Chunks that need to be tagged are initialized while being tagged (see memoryTagAndInit), so every granule
+ *       is written once. Chunks already tagged (retagged when freed) only get init copied.
+ */
+MTELIBEXPORT void* taggedArenaAllocInit(TaggedArena* arena, size_t size, const void* init, size_t initSize) {
+    return taggedArenaAllocWith(arena, size, NULL, init, initSize);
+}
+
+/**
+ * @brief Return a chunk to the arena
+ *
+ * @param arena Arena the chunk was allocated from
+ * @param ptr Tagged pointer returned by taggedArenaAlloc (NULL is ignored)
+ * @note The chunk is zero'ed and retagged with a different tag, so that stale pointers fault.
+ * @note If the chunk's size class retags on allocation, stale pointers and double frees go undetected until the chunk is reused.
+ * @note Chunks of unsampled allocations are only zero'ed: stale pointers and double frees go undetected.
+ */
+MTELIBEXPORT void taggedArenaFree(TaggedArena* arena, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    const uintptr_t offset = (uintptr_t)pointerSetTag(ptr, 0) - (uintptr_t)arena->base;
+    MTE_ASSERT(offset < arena->used, "Pointer doesn't belong to arena");
+
+    const size_t classIndex = arena->slabClasses[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE];
+    MTE_ASSERT(classIndex != TAGGED_ARENA_NO_CLASS, "Pointer doesn't belong to a slab");
+    const size_t classSize = taggedArenaClassSize(classIndex);
+    MTE_ASSERT((offset & (TAGGED_ARENA_SLAB_SIZE - 1)) % classSize == 0, "Pointer isn't the start of a chunk");
+
+    //Tag stores aren't tag-checked: go through a checked load first so that double frees fault.
+    (void)*(volatile char*)ptr;
+
+    TaggedArenaClass* const sc = &arena->classes[classIndex];
+    sc->frees++;
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    taggedArenaGetChunkInfo(arena, offset, classSize)->live = 0;
+#endif
+
+    //Chunks of sampled allocations never get TAGGED_ARENA_FREE_TAG, so this one wasn't sampled: keep its tag.
+    if (pointerGetTag(ptr) == TAGGED_ARENA_FREE_TAG) {
+        memset(ptr, 0, classSize);
+        TaggedArenaFreeChunk* const chunk = (TaggedArenaFreeChunk*)ptr;
+        chunk->next = sc->untaggedList;
+        sc->untaggedList = chunk;
+        return;
+    }
+
+    if (taggedArenaResolveRetagMode(arena, classIndex) == TAGGED_ARENA_RETAG_ON_ALLOC) {
+        TaggedArenaFreeChunk* const chunk = (TaggedArenaFreeChunk*)ptr;
+        chunk->next = sc->staleList;
+        sc->staleList = chunk;
+        sc->staleCount++;
+        return;
+    }
+
+    TaggedArenaFreeChunk* const chunk = (TaggedArenaFreeChunk*)taggedArenaRetag(arena, ptr, classSize, TAGGED_ARENA_RETAG_ON_FREE, NULL, 0);
+    chunk->next = sc->freeList;
+    sc->freeList = chunk;
+}
+
+/**
+ * @brief Resize an allocation, in place when it fits in its chunk
+ *
+ * @param arena Arena the chunk was allocated from
+ * @param ptr Tagged pointer returned by taggedArenaAlloc (NULL to allocate a new chunk)
+ * @param oldSize Current size of the allocation (the size given to taggedArenaAlloc or to the last taggedArenaRealloc)
+ * @param newSize New size of the allocation (at most TAGGED_ARENA_MAX_SIZE)
+ * @return Tagged pointer to the allocation, or NULL if the arena is exhausted (ptr is left untouched then)
+ * @note Allocations stay in place as long as newSize fits in the size class of their chunk: when shrinking, the granules
+ *       past newSize are retagged with another tag so that accesses to them fault, and when growing again, only the granules
+ *       added back are tagged (and zero'ed) with the pointer's tag. Buffers expected to grow can thus be allocated at their
+ *       capacity, then shrunk to the size they actually use.
+ * @note Otherwise, the allocation is copied to a new chunk and its old chunk is freed.
+ */
+MTELIBEXPORT void* taggedArenaRealloc(TaggedArena* arena, void* ptr, size_t oldSize, size_t newSize) {
+    MTE_ASSERT(newSize <= TAGGED_ARENA_MAX_SIZE, "Allocation too large for arena");
+    if (ptr == NULL) {
+        return taggedArenaAlloc(arena, newSize);
+    }
+
+    const uintptr_t offset = (uintptr_t)pointerSetTag(ptr, 0) - (uintptr_t)arena->base;
+    MTE_ASSERT(offset < arena->used, "Pointer doesn't belong to arena");
+    const size_t classIndex = arena->slabClasses[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE];
+    MTE_ASSERT(classIndex != TAGGED_ARENA_NO_CLASS, "Pointer doesn't belong to a slab");
+    const size_t classSize = taggedArenaClassSize(classIndex);
+    MTE_ASSERT(oldSize <= classSize, "Size larger than the allocation's chunk");
+
+    if (newSize > classSize) {
+        void* const moved = taggedArenaAlloc(arena, newSize);
+        if (moved == NULL) {
+            return NULL;
+        }
+        memcpy(moved, ptr, oldSize);
+        taggedArenaFree(arena, ptr);
+        return moved;
+    }
+
+    //Allocations always keep at least their first granule, which taggedArenaFree checks.
+    const size_t oldEnd = taggedArenaClassSize(taggedArenaClassIndex(oldSize));
+    const size_t newEnd = taggedArenaClassSize(taggedArenaClassIndex(newSize));
+    char* const chunk = (char*)ptr;
+    if (pointerGetTag(ptr) == TAGGED_ARENA_FREE_TAG) {
+        //Chunks of unsampled allocations keep TAGGED_ARENA_FREE_TAG everywhere.
+        if (newEnd > oldEnd) {
+            memset(chunk + oldEnd, 0, newEnd - oldEnd);
+        }
+    } else if (newEnd > oldEnd) {
+        memoryTagAndZero(chunk + oldEnd, newEnd - oldEnd);
+    } else if (newEnd < oldEnd) {
+        memoryTag(pointerSetTagFromSource(chunk + newEnd, excludeMaskAddPtrTag(arena->excluded, ptr)), oldEnd - newEnd);
+    }
+
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    taggedArenaGetChunkInfo(arena, offset, classSize)->size = (uint32_t)newSize;
+#endif
+    return ptr;
+}
+
+/**
+ * @brief Select when chunks of a size class get retagged
+ *
+ * @param arena Arena to configure
+ * @param size Any allocation size belonging to the size class
+ * @param mode Retag mode for the size class (TAGGED_ARENA_RETAG_ON_FREE by default)
+ * @note Chunks already freed keep the state they were freed in.
+ */
+MTELIBEXPORT void taggedArenaSetRetagMode(TaggedArena* arena, size_t size, TaggedArenaRetagMode mode) {
+    MTE_ASSERT(size <= TAGGED_ARENA_MAX_SIZE, "Size too large for arena");
+    arena->retagModes[taggedArenaClassIndex(size)] = (uint8_t)mode;
+}
+
+/**
+ * @brief Select the fraction of allocations that get a random tag
+ *
+ * @param arena Arena to configure
+ * @param rate 1 to tag every allocation (the default), N to tag 1 in N allocations, 0 to only tag size classes set with taggedArenaSetClassSampled
+ * @note Unsampled allocations are tagged with TAGGED_ARENA_FREE_TAG and never go through STG: overflows from and into
+ *       sampled chunks still fault, but those within unsampled chunks don't.
+ * @note Takes effect on the next allocation. Sampling is decided by a countdown of the arena, restarted here.
+ */
+MTELIBEXPORT void taggedArenaSetSampleRate(TaggedArena* arena, uint32_t rate) {
+    arena->sampleRate = rate;
+    arena->sampleCountdown = 0;
+}
+
+/**
+ * @brief Select whether a size class is tagged regardless of the sampling rate
+ *
+ * @param arena Arena to configure
+ * @param size Any allocation size belonging to the size class
+ * @param always Non-zero to tag every allocation of the size class, 0 to follow the sampling rate (the default)
+ */
+MTELIBEXPORT void taggedArenaSetClassSampled(TaggedArena* arena, size_t size, int always) {
+    MTE_ASSERT(size <= TAGGED_ARENA_MAX_SIZE, "Size too large for arena");
+    arena->alwaysSampled[taggedArenaClassIndex(size)] = (uint8_t)(always != 0);
+}
+
+/**
+ * @brief Get tag store counters of a retag mode
+ *
+ * @param arena Arena to query
+ * @param mode TAGGED_ARENA_RETAG_ON_FREE or TAGGED_ARENA_RETAG_ON_ALLOC
+ * @return Counters of retags performed in that mode
+ * @note granulesAvoided counts chunks freed in TAGGED_ARENA_RETAG_ON_ALLOC mode that were discarded by taggedArenaReset
+ *       before being reused, as well as those still waiting in a free list.
+ */
+MTELIBEXPORT TaggedArenaRetagStats taggedArenaGetRetagStats(const TaggedArena* arena, TaggedArenaRetagMode mode) {
+    MTE_ASSERT(mode < TAGGED_ARENA_NUM_RETAG_MODES, "Invalid retag mode");
+    TaggedArenaRetagStats stats = arena->retagStats[mode];
+    if (mode == TAGGED_ARENA_RETAG_ON_ALLOC) {
+        for (size_t i = 0; i < TAGGED_ARENA_NUM_CLASSES; i++) {
+            stats.granulesAvoided += arena->classes[i].staleCount * (taggedArenaClassSize(i) >> LOG2_TAG_GRANULE_SIZE);
+        }
+    }
+    return stats;
+}
+
+/**
+ * @brief Free all chunks of an arena at once
+ *
+ * @param arena Arena to reset
+ * @note All used memory is zero'ed and tagged with TAGGED_ARENA_FREE_TAG, so every outstanding pointer to a sampled
+ *       chunk faults. Pointers to unsampled chunks already have TAGGED_ARENA_FREE_TAG, and don't.
+ */
+MTELIBEXPORT void taggedArenaReset(TaggedArena* arena) {
+    memoryTagAndZero(pointerSetTag(arena->base, TAGGED_ARENA_FREE_TAG), arena->used);
+    memset(arena->slabClasses, TAGGED_ARENA_NO_CLASS, arena->used >> TAGGED_ARENA_LOG2_SLAB_SIZE);
+#ifdef TAGGED_ARENA_TRACK_CHUNKS
+    memset(arena->chunkInfo, 0, taggedArenaChunkInfoSize(arena->used));
+#endif
+    for (size_t i = 0; i < TAGGED_ARENA_NUM_CLASSES; i++) {
+        arena->retagStats[TAGGED_ARENA_RETAG_ON_ALLOC].granulesAvoided +=
+            arena->classes[i].staleCount * (taggedArenaClassSize(i) >> LOG2_TAG_GRANULE_SIZE);
+    }
+    memset(arena->classes, 0, sizeof(arena->classes));
+    arena->used = 0;
+}
+
+#endif //MTELIB_ARENA_H
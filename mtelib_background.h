@@ -0,0 +1,218 @@
+/**
+ * @file mtelib_background.h
+ * @author CreepNT
+ * @brief Incremental tagging of large areas by a background thread, with per-chunk readiness tracking
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Chunks are tagged from the lowest address up, which is the order bump allocators hand memory out in.
+ *       Threads needing memory that isn't ready yet tag the missing chunks themselves instead of waiting for them.
+ */
+
+#ifndef MTELIB_BACKGROUND_H
+#define MTELIB_BACKGROUND_H
+
+#include "mtelib.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint64_t, uintptr_t
+#include <string.h> //memset
+
+#include <sys/mman.h>
+
+#define BACKGROUND_TAGGER_BITS_PER_WORD (64U)
+
+typedef struct BackgroundTagger {
+    char* base;             //Untagged
+    size_t size;
+    uint64_t tag;           //Tag given to the area
+    size_t chunkSize;
+    size_t chunkCount;
+    int zero;               //Chunks are zero'ed out while tagged
+
+    //Bitmaps of chunks being tagged (or done), and of chunks done. Readers only need the latter.
+    _Atomic uint64_t* claimed;
+    _Atomic uint64_t* ready;
+    size_t bitmapWords;
+
+    _Atomic size_t cursor;  //Lowest chunk the background thread hasn't looked at yet
+    _Atomic int stop;
+    pthread_t thread;
+
+    //Signaled every time a chunk is done, for threads waiting on chunks tagged by another thread.
+    pthread_mutex_t lock;
+    pthread_cond_t chunkDone;
+} BackgroundTagger;
+
+MTELIBINTERNAL int backgroundTaggerIsChunkReady(BackgroundTagger* tagger, size_t chunk) {
+    const uint64_t bit = 1ULL << (chunk % BACKGROUND_TAGGER_BITS_PER_WORD);
+    return (atomic_load_explicit(&tagger->ready[chunk / BACKGROUND_TAGGER_BITS_PER_WORD], memory_order_acquire) & bit) != 0;
+}
+
+//Tag a chunk if no other thread has claimed it, returns 0 if it was claimed already.
+MTELIBINTERNAL int backgroundTaggerTagChunk(BackgroundTagger* tagger, size_t chunk) {
+    const size_t word = chunk / BACKGROUND_TAGGER_BITS_PER_WORD;
+    const uint64_t bit = 1ULL << (chunk % BACKGROUND_TAGGER_BITS_PER_WORD);
+    if (atomic_fetch_or_explicit(&tagger->claimed[word], bit, memory_order_relaxed) & bit) {
+        return 0;
+    }
+
+    const size_t offset = chunk * tagger->chunkSize;
+    const size_t size = (offset + tagger->chunkSize <= tagger->size) ? tagger->chunkSize : tagger->size - offset;
+    void* const ptr = pointerSetTag(tagger->base + offset, tagger->tag);
+    if (tagger->zero) {
+        memoryTagAndZero(ptr, size);
+    } else {
+        memoryTag(ptr, size);
+    }
+
+    atomic_fetch_or_explicit(&tagger->ready[word], bit, memory_order_release);
+    pthread_mutex_lock(&tagger->lock);
+    pthread_cond_broadcast(&tagger->chunkDone);
+    pthread_mutex_unlock(&tagger->lock);
+    return 1;
+}
+
+MTELIBINTERNAL void* backgroundTaggerMain(void* arg) {
+    BackgroundTagger* const tagger = (BackgroundTagger*)arg;
+    while (!atomic_load_explicit(&tagger->stop, memory_order_relaxed)) {
+        const size_t chunk = atomic_fetch_add_explicit(&tagger->cursor, 1, memory_order_relaxed);
+        if (chunk >= tagger->chunkCount) {
+            break;
+        }
+        backgroundTaggerTagChunk(tagger, chunk);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start tagging an area in the background
+ *
+ * @param tagger Tagger to initialize
+ * @param ptr Tagged pointer to area that gets tagged with the tag in ptr itself
+ * @param size Size of the area to tag (must be aligned to tag boundary)
+ * @param chunkSize Size of the chunks readiness is tracked for (must be aligned to tag boundary)
+ * @param zero Whether the area should be zero'ed out while being tagged (memoryTagAndZero instead of memoryTag)
+ * @return 0 on success, -1 on failure (errno is set by mmap or to the error returned by pthread_create)
+ */
+MTELIBEXPORT int backgroundTaggerStart(BackgroundTagger* tagger, void* ptr, size_t size, size_t chunkSize, int zero) {
+    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+    MTE_ASSERT(chunkSize != 0 && (chunkSize & GRANULE_ALIGNMENT_MASK) == 0, "Invalid chunk size");
+    memset(tagger, 0, sizeof(*tagger));
+
+    tagger->base = (char*)pointerSetTag(ptr, 0);
+    tagger->size = size;
+    tagger->tag = pointerGetTag(ptr);
+    tagger->chunkSize = chunkSize;
+    tagger->chunkCount = (size + chunkSize - 1) / chunkSize;
+    tagger->zero = zero;
+    tagger->bitmapWords = (tagger->chunkCount + BACKGROUND_TAGGER_BITS_PER_WORD - 1) / BACKGROUND_TAGGER_BITS_PER_WORD;
+
+    //Zero'ed by mmap, both bitmaps live in the same mapping.
+    void* bitmaps = mmap(NULL, 2 * tagger->bitmapWords * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bitmaps == MAP_FAILED) {
+        return -1;
+    }
+    tagger->claimed = (_Atomic uint64_t*)bitmaps;
+    tagger->ready = tagger->claimed + tagger->bitmapWords;
+
+    atomic_init(&tagger->cursor, 0);
+    atomic_init(&tagger->stop, 0);
+    pthread_mutex_init(&tagger->lock, NULL);
+    pthread_cond_init(&tagger->chunkDone, NULL);
+
+    const int error = pthread_create(&tagger->thread, NULL, backgroundTaggerMain, tagger);
+    if (error != 0) {
+        pthread_cond_destroy(&tagger->chunkDone);
+        pthread_mutex_destroy(&tagger->lock);
+        munmap(bitmaps, 2 * tagger->bitmapWords * sizeof(uint64_t));
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check whether part of the area has been tagged
+ *
+ * @param tagger Tagger of the area
+ * @param ptr Pointer (tagged or not) to the start of the part to check
+ * @param size Size of the part to check
+ * @return 1 if the whole part is ready for use, 0 otherwise
+ * @note Only reads the ready bitmap, and never blocks.
+ */
+MTELIBEXPORT int backgroundTaggerIsReady(BackgroundTagger* tagger, void* ptr, size_t size) {
+    const size_t offset = (size_t)((char*)pointerSetTag(ptr, 0) - tagger->base);
+    MTE_ASSERT(offset + size <= tagger->size, "Part is outside of the area");
+    if (size == 0) {
+        return 1;
+    }
+
+    const size_t last = (offset + size - 1) / tagger->chunkSize;
+    for (size_t chunk = offset / tagger->chunkSize; chunk <= last; chunk++) {
+        if (!backgroundTaggerIsChunkReady(tagger, chunk)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Make sure part of the area has been tagged before returning
+ *
+ * @param tagger Tagger of the area
+ * @param ptr Pointer (tagged or not) to the start of the part that is needed
+ * @param size Size of the part that is needed
+ * @note Chunks nobody has started tagging yet are tagged by the calling thread, only chunks being tagged
+ *       by another thread are waited for.
+ */
+MTELIBEXPORT void backgroundTaggerWait(BackgroundTagger* tagger, void* ptr, size_t size) {
+    const size_t offset = (size_t)((char*)pointerSetTag(ptr, 0) - tagger->base);
+    MTE_ASSERT(offset + size <= tagger->size, "Part is outside of the area");
+    if (size == 0) {
+        return;
+    }
+
+    const size_t first = offset / tagger->chunkSize;
+    const size_t last = (offset + size - 1) / tagger->chunkSize;
+    for (size_t chunk = first; chunk <= last; chunk++) {
+        if (!backgroundTaggerIsChunkReady(tagger, chunk)) {
+            backgroundTaggerTagChunk(tagger, chunk);
+        }
+    }
+
+    for (size_t chunk = first; chunk <= last; chunk++) {
+        if (backgroundTaggerIsChunkReady(tagger, chunk)) {
+            continue;
+        }
+        pthread_mutex_lock(&tagger->lock);
+        while (!backgroundTaggerIsChunkReady(tagger, chunk)) {
+            pthread_cond_wait(&tagger->chunkDone, &tagger->lock);
+        }
+        pthread_mutex_unlock(&tagger->lock);
+    }
+}
+
+/**
+ * @brief Stop background tagging, then release the tagger's resources
+ *
+ * @param tagger Tagger to destroy
+ * @param finish Whether the rest of the area must be tagged: if 0, tagging stops after the chunks being tagged
+ * @note The tagger must not be used by other threads anymore.
+ */
+MTELIBEXPORT void backgroundTaggerStop(BackgroundTagger* tagger, int finish) {
+    if (!finish) {
+        atomic_store_explicit(&tagger->stop, 1, memory_order_relaxed);
+    }
+    pthread_join(tagger->thread, NULL);
+
+    pthread_cond_destroy(&tagger->chunkDone);
+    pthread_mutex_destroy(&tagger->lock);
+    munmap((void*)tagger->claimed, 2 * tagger->bitmapWords * sizeof(uint64_t));
+    memset(tagger, 0, sizeof(*tagger));
+}
+
+#endif //MTELIB_BACKGROUND_H
@@ -0,0 +1,144 @@
+/**
+ * @file mtelib_dispatch.h
+ * @author CreepNT
+ * @brief Runtime selection of mtelib.h kernels, for binaries that must also run on CPUs without MTE
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note CPU features are detected on first call of any dispatch* function, which selects a function pointer
+ *       table; later calls only load the table pointer. When MTE is absent, tagging is a no-op and zeroing/copying
+ *       use memset/memcpy.
+ * @note All state lives in function-local statics of MTELIBEXPORT functions, so that C++ translation units share it.
+ */
+
+#ifndef MTELIB_DISPATCH_H
+#define MTELIB_DISPATCH_H
+
+#include "mtelib.h"
+
+#include <pthread.h> //pthread_once
+#include <stddef.h> //size_t
+#include <string.h> //memcpy, memset
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP2_MTE
+    #define HWCAP2_MTE  (1UL << 18)
+#endif
+
+#ifndef HWCAP2_MTE3
+    #define HWCAP2_MTE3 (1UL << 22)
+#endif
+
+typedef struct MTEFeatures {
+    int mte;             //FEAT_MTE2: tag storage and tag checks are available
+    int mte3;            //FEAT_MTE3: asymmetric tag check faults are available
+    size_t dczBlockSize; //Size of DC GVA/DC GZVA blocks, or 0 if they cannot be used
+    size_t gmBlockSize;  //Size of LDGM/STGM blocks (from GMID_EL1), or 0 if they cannot be used (without MTELIB_PRIVILEGED)
+} MTEFeatures;
+
+typedef struct MTEKernels {
+    const char* name;
+    void (*memoryTag)(void* ptr, size_t size);
+    void (*memoryTagAndZero)(void* ptr, size_t size);
+    void (*memoryTagAndZeroStreaming)(void* ptr, size_t size);
+    void (*memoryTagAndCopy)(void* dst, const void* src, size_t size);
+    void* (*setRandomTag)(void* ptr, ExcludeMask excluded); //Not named after pointerSetRandomTag, which may be a macro
+} MTEKernels;
+
+//Storage of mteGetFeatures, filled once by mteDetectFeatures.
+MTELIBEXPORT MTEFeatures* mteFeaturesStorage(void) {
+    static MTEFeatures features;
+    return &features;
+}
+
+MTELIBINTERNAL void mteDetectFeatures(void) {
+    MTEFeatures* const features = mteFeaturesStorage();
+    const unsigned long hwcap2 = getauxval(AT_HWCAP2);
+    features->mte = (hwcap2 & HWCAP2_MTE) != 0;
+    features->mte3 = (hwcap2 & HWCAP2_MTE3) != 0;
+    //MTE instructions (including DC GVA) are UNDEFINED without MTE, and GMID_EL1 can only be read from EL1.
+    features->dczBlockSize = features->mte ? memoryGetDCZBlockSize() : 0;
+    features->gmBlockSize = features->mte ? memoryGetGMBlockSize() : 0;
+}
+
+/**
+ * @brief Detect MTE-related CPU features
+ *
+ * @return Detected features
+ * @note Features are only detected on first call, the result is cached afterwards.
+ */
+MTELIBEXPORT const MTEFeatures* mteGetFeatures(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, mteDetectFeatures);
+    return mteFeaturesStorage();
+}
+
+/* Kernels used without MTE: memory is never tagged, and pointer tags are ignored thanks to TBI. */
+MTELIBINTERNAL void memoryTagNoMTE(void* ptr, size_t size) {
+    (void)ptr; (void)size;
+}
+
+MTELIBINTERNAL void memoryTagAndZeroNoMTE(void* ptr, size_t size) {
+    memset(ptr, 0, size);
+}
+
+MTELIBINTERNAL void memoryTagAndCopyNoMTE(void* dst, const void* src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+MTELIBINTERNAL void* pointerSetRandomTagNoMTE(void* ptr, ExcludeMask excluded) {
+    (void)excluded;
+    return ptr;
+}
+
+/* Kernels used with MTE */
+MTELIBINTERNAL void* pointerSetRandomTagMTE(void* ptr, ExcludeMask excluded) {
+    return pointerSetRandomTag(ptr, excluded);
+}
+
+static const MTEKernels mteKernelsNoMTE = {
+    "none", memoryTagNoMTE, memoryTagAndZeroNoMTE, memoryTagAndZeroNoMTE, memoryTagAndCopyNoMTE, pointerSetRandomTagNoMTE,
+};
+
+static const MTEKernels mteKernelsMTE = {
+    "mte", memoryTag, memoryTagAndZero, memoryTagAndZeroStreaming, memoryTagAndCopy, pointerSetRandomTagMTE,
+};
+
+/**
+ * @brief Get the kernels selected for this CPU
+ *
+ * @return Kernel table (name is "none" without MTE, "mte" otherwise)
+ * @note Once the kernels are selected, this is a single acquire load. Threads racing to select them store the same table.
+ */
+MTELIBEXPORT const MTEKernels* mteGetKernels(void) {
+    static const MTEKernels* selected;
+    const MTEKernels* kernels = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(kernels == NULL, 0)) {
+        kernels = mteGetFeatures()->mte ? &mteKernelsMTE : &mteKernelsNoMTE;
+        __atomic_store_n(&selected, kernels, __ATOMIC_RELEASE);
+    }
+    return kernels;
+}
+
+/* Dispatched primitives: same contracts as their mtelib.h counterparts. */
+MTELIBEXPORT void dispatchMemoryTag(void* ptr, size_t size) {
+    mteGetKernels()->memoryTag(ptr, size);
+}
+
+MTELIBEXPORT void dispatchMemoryTagAndZero(void* ptr, size_t size) {
+    mteGetKernels()->memoryTagAndZero(ptr, size);
+}
+
+MTELIBEXPORT void dispatchMemoryTagAndZeroStreaming(void* ptr, size_t size) {
+    mteGetKernels()->memoryTagAndZeroStreaming(ptr, size);
+}
+
+MTELIBEXPORT void dispatchMemoryTagAndCopy(void* dst, const void* src, size_t size) {
+    mteGetKernels()->memoryTagAndCopy(dst, src, size);
+}
+
+MTELIBEXPORT void* dispatchPointerSetRandomTag(void* ptr, ExcludeMask excluded) {
+    return mteGetKernels()->setRandomTag(ptr, excluded);
+}
+
+#endif //MTELIB_DISPATCH_H
@@ -0,0 +1,202 @@
+/**
+ * @file mtelib_fault.h
+ * @author CreepNT
+ * @brief Attribution of tag check faults to tagged arena chunks, from signal handlers
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Looking a fault address up goes through registered arenas (a handful of range checks), then through
+ *       the arena's slab table: it takes constant time, never locks and never allocates.
+ */
+
+#ifndef MTELIB_FAULT_H
+#define MTELIB_FAULT_H
+
+#include "mtelib.h"
+#include "mtelib_arena.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint64_t, uintptr_t
+#include <unistd.h> //write
+
+#ifndef SA_EXPOSE_TAGBITS
+    #define SA_EXPOSE_TAGBITS (0x00000800)
+#endif
+
+/* Configuration options */
+//MTE_FAULT_MAX_ARENAS: largest number of arenas registered at once.
+
+#ifndef MTE_FAULT_MAX_ARENAS
+    #define MTE_FAULT_MAX_ARENAS (16U)
+#endif
+
+typedef struct MTEFaultInfo {
+    void* address;              //Faulting address, with its pointer tag
+    uint64_t pointerTag;        //Tag of the faulting pointer
+    uint64_t memoryTag;         //Allocation tag of the faulting granule
+    const TaggedArena* arena;   //Arena the address belongs to, NULL if none
+    void* chunk;                //Untagged start of the chunk containing the address, NULL if none
+    size_t chunkSize;           //Size of the chunk's size class
+    size_t requestedSize;       //Size given to the allocator, 0 if unknown
+    const void* site;           //Allocation site of the chunk, NULL if unknown
+    int live;                   //1 if the chunk is allocated, 0 if it was freed, -1 if unknown
+} MTEFaultInfo;
+
+MTELIBINTERNAL const TaggedArena* _Atomic* mteFaultArenas(void) {
+    static const TaggedArena* _Atomic arenas[MTE_FAULT_MAX_ARENAS];
+    return arenas;
+}
+
+/**
+ * @brief Make faults in an arena attributable by mteFaultLookup
+ *
+ * @param arena Arena to register
+ * @return 0 on success, -1 if too many arenas are registered (errno is set to ENOSPC)
+ */
+MTELIBEXPORT int mteFaultRegisterArena(const TaggedArena* arena) {
+    const TaggedArena* _Atomic* const arenas = mteFaultArenas();
+    for (size_t i = 0; i < MTE_FAULT_MAX_ARENAS; i++) {
+        const TaggedArena* expected = NULL;
+        if (atomic_compare_exchange_strong(&arenas[i], &expected, arena)) {
+            return 0;
+        }
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+/**
+ * @brief Stop attributing faults to an arena, which must be done before destroying it
+ *
+ * @param arena Arena to unregister
+ */
+MTELIBEXPORT void mteFaultUnregisterArena(const TaggedArena* arena) {
+    const TaggedArena* _Atomic* const arenas = mteFaultArenas();
+    for (size_t i = 0; i < MTE_FAULT_MAX_ARENAS; i++) {
+        const TaggedArena* expected = arena;
+        atomic_compare_exchange_strong(&arenas[i], &expected, NULL);
+    }
+}
+
+/**
+ * @brief Find the chunk a fault address belongs to
+ *
+ * @param address Faulting address (si_addr, with tag bits if the handler was installed with SA_EXPOSE_TAGBITS)
+ * @param info Receives what is known about the fault
+ * @return 0 if the address belongs to a chunk of a registered arena, -1 otherwise
+ * @note Async-signal-safe. The allocation tag is only read (using LDG) if the address belongs to an arena.
+ */
+MTELIBEXPORT int mteFaultLookup(void* address, MTEFaultInfo* info) {
+    info->address = address;
+    info->pointerTag = pointerGetTag(address);
+    info->memoryTag = 0;
+    info->arena = NULL;
+    info->chunk = NULL;
+    info->chunkSize = 0;
+    info->requestedSize = 0;
+    info->site = NULL;
+    info->live = -1;
+
+    const uintptr_t untagged = (uintptr_t)pointerSetTag(address, 0);
+    const TaggedArena* _Atomic* const arenas = mteFaultArenas();
+    for (size_t i = 0; i < MTE_FAULT_MAX_ARENAS; i++) {
+        const TaggedArena* const arena = atomic_load_explicit(&arenas[i], memory_order_acquire);
+        if (arena == NULL || untagged - (uintptr_t)arena->base >= arena->size) {
+            continue;
+        }
+
+        info->arena = arena;
+        info->memoryTag = memoryGetTag((void*)untagged);
+
+        const size_t offset = untagged - (uintptr_t)arena->base;
+        const size_t classIndex = (offset < arena->used) ? arena->slabClasses[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE] : TAGGED_ARENA_NO_CLASS;
+        if (classIndex == TAGGED_ARENA_NO_CLASS) {
+            return -1;
+        }
+
+        const size_t classSize = taggedArenaClassSize(classIndex);
+        const size_t slabOffset = offset & (TAGGED_ARENA_SLAB_SIZE - 1);
+        info->chunk = arena->base + (offset - slabOffset) + (slabOffset / classSize) * classSize;
+        info->chunkSize = classSize;
+
+        const TaggedArenaChunkInfo* const chunkInfo = taggedArenaGetChunkInfo(arena, offset, classSize);
+        if (chunkInfo != NULL) {
+            info->requestedSize = chunkInfo->size;
+            info->site = chunkInfo->site;
+            info->live = (int)chunkInfo->live;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+//Append a string/an hexadecimal number to a buffer, returns the new end of the buffer.
+MTELIBINTERNAL char* mteFaultAppend(char* out, const char* end, const char* str) {
+    while (*str != '\0' && out < end) {
+        *out++ = *str++;
+    }
+    return out;
+}
+
+MTELIBINTERNAL char* mteFaultAppendHex(char* out, const char* end, uint64_t value) {
+    char digits[18] = "0x";
+    int length = 2;
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        const unsigned digit = (unsigned)(value >> shift) & 0xF;
+        if (digit != 0 || length > 2 || shift == 0) {
+            digits[length++] = "0123456789abcdef"[digit];
+        }
+    }
+
+    for (int i = 0; i < length && out < end; i++) {
+        *out++ = digits[i];
+    }
+    return out;
+}
+
+/**
+ * @brief Print what is known about a tag check fault to stderr
+ *
+ * @param si Signal information given to the SIGSEGV handler
+ * @note Async-signal-safe: the report is formatted on the stack and printed using a single write().
+ * @note Only call this for tag check faults (SEGV_MTESERR), as the allocation tag of si_addr is read.
+ */
+MTELIBEXPORT void mteFaultReport(const siginfo_t* si) {
+    MTEFaultInfo info;
+    const int found = mteFaultLookup(si->si_addr, &info);
+    if (info.arena == NULL) {
+        info.memoryTag = memoryGetTag(pointerSetTag(si->si_addr, 0));
+    }
+
+    char buffer[256];
+    char* const end = buffer + sizeof(buffer) - 1;
+    char* out = buffer;
+    out = mteFaultAppend(out, end, "MTE fault at ");
+    out = mteFaultAppendHex(out, end, (uint64_t)(uintptr_t)info.address);
+    out = mteFaultAppend(out, end, ": pointer tag ");
+    out = mteFaultAppendHex(out, end, info.pointerTag);
+    out = mteFaultAppend(out, end, ", memory tag ");
+    out = mteFaultAppendHex(out, end, info.memoryTag);
+    if (found == 0) {
+        out = mteFaultAppend(out, end, ", chunk ");
+        out = mteFaultAppendHex(out, end, (uint64_t)(uintptr_t)info.chunk);
+        out = mteFaultAppend(out, end, " of size ");
+        out = mteFaultAppendHex(out, end, info.chunkSize);
+        if (info.live >= 0) {
+            out = mteFaultAppend(out, end, info.live ? " (allocated" : " (freed");
+            out = mteFaultAppend(out, end, ", requested ");
+            out = mteFaultAppendHex(out, end, info.requestedSize);
+            out = mteFaultAppend(out, end, " from ");
+            out = mteFaultAppendHex(out, end, (uint64_t)(uintptr_t)info.site);
+            out = mteFaultAppend(out, end, ")");
+        }
+    }
+    *out++ = '\n';
+
+    const ssize_t written = write(STDERR_FILENO, buffer, (size_t)(out - buffer));
+    (void)written;
+}
+
+#endif //MTELIB_FAULT_H
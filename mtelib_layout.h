@@ -0,0 +1,197 @@
+/**
+ * @file mtelib_layout.h
+ * @author CreepNT
+ * @brief Slab layouts: slot geometry, optional redzones, neighbour-aware tag selection and one-pass slab tagging
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Slot tags are kept in a packed tag array (one nibble per slot) owned by the caller, so that the tags legal
+ *       for a slot can be found from it without touching the slab.
+ * @note The first granule of a slab never belongs to a slot and is tagged with SLAB_LAYOUT_REDZONE_TAG, so that
+ *       slots never share a tag with the last slot of the slab placed before theirs either.
+ */
+
+#ifndef MTELIB_LAYOUT_H
+#define MTELIB_LAYOUT_H
+
+#include "mtelib.h"
+
+#include <stddef.h> //size_t
+#include <stdint.h> //uint8_t, uint64_t, uintptr_t
+
+/* Configuration options */
+//SLAB_LAYOUT_REDZONE_TAG: tag given to redzones, and to the first granule and unused tail of slabs, never given to slots.
+
+#ifndef SLAB_LAYOUT_REDZONE_TAG
+    #define SLAB_LAYOUT_REDZONE_TAG (MAX_TAG)
+#endif
+
+typedef struct SlabLayout {
+    size_t slabSize;
+    size_t slotSize;        //Usable size of each slot
+    size_t stride;          //Distance between the starts of consecutive slots
+    size_t firstSlot;       //Offset of the first slot from the start of the slab (always one granule)
+    size_t slotCount;
+    int redzones;           //Slots are separated by single-granule redzones
+    ExcludeMask excluded;   //Tags never given to slots (always contains MAX_TAG and SLAB_LAYOUT_REDZONE_TAG)
+} SlabLayout;
+
+//Size (in bytes) of the packed tag array holding the slot tags of a slab.
+#define SLAB_LAYOUT_TAGS_SIZE(layout) (((layout)->slotCount + 1) / 2)
+
+/**
+ * @brief Compute the geometry of slabs holding slots of a single size
+ *
+ * @param layout Layout to initialize
+ * @param slabSize Size of slabs (must be aligned to tag boundary)
+ * @param slotSize Usable size of each slot (must be aligned to tag boundary)
+ * @param redzones Whether slots are surrounded by single-granule redzones tagged with SLAB_LAYOUT_REDZONE_TAG
+ * @param excluded Tags that must never be given to slots
+ * @note Without redzones, neighbouring slots never share a tag instead.
+ */
+MTELIBEXPORT void slabLayoutInit(SlabLayout* layout, size_t slabSize, size_t slotSize, int redzones, ExcludeMask excluded) {
+    VERIFY_ALIGNMENT(slabSize, GRANULE_ALIGNMENT_MASK);
+    MTE_ASSERT(slotSize != 0 && (slotSize & GRANULE_ALIGNMENT_MASK) == 0, "Invalid slot size");
+
+    const size_t redzoneSize = redzones ? GRANULE_SIZE : 0;
+    MTE_ASSERT(slabSize >= GRANULE_SIZE + slotSize + redzoneSize, "Slab too small for a single slot");
+
+    //The leading granule doubles as the left redzone of the first slot.
+    layout->slabSize = slabSize;
+    layout->slotSize = slotSize;
+    layout->stride = slotSize + redzoneSize;
+    layout->firstSlot = GRANULE_SIZE;
+    layout->slotCount = (slabSize - GRANULE_SIZE) / layout->stride;
+    layout->redzones = redzones;
+    layout->excluded = excludeMaskAddTag(excludeMaskAddTag(excluded, MAX_TAG), SLAB_LAYOUT_REDZONE_TAG);
+
+    //Retagging a slot excludes its own tag, as well as those of both its neighbours when there are no redzones.
+    MTE_ASSERT(16 - __builtin_popcountll(layout->excluded & 0xFFFFULL) >= (redzones ? 2 : 4), "Not enough tags left for slots");
+}
+
+/**
+ * @brief Get the tags a slot may be retagged with
+ *
+ * @param layout Layout of the slab
+ * @param tags Packed tag array of the slab
+ * @param slot Index of the slot
+ * @return Exclude mask of the layout, plus the slot's current tag and, without redzones, the tags of its neighbours
+ */
+MTELIBEXPORT ExcludeMask slabLayoutSlotExcludeMask(const SlabLayout* layout, const uint8_t* tags, size_t slot) {
+    ExcludeMask mask = excludeMaskAddTag(layout->excluded, packedTagsGet(tags, slot));
+    if (!layout->redzones) {
+        if (slot > 0) {
+            mask = excludeMaskAddTag(mask, packedTagsGet(tags, slot - 1));
+        }
+        if (slot + 1 < layout->slotCount) {
+            mask = excludeMaskAddTag(mask, packedTagsGet(tags, slot + 1));
+        }
+    }
+    return mask;
+}
+
+//Tag granules from ptr to end straight away, without going through the size checks of memoryTag/memoryTagAndZero.
+MTELIBINTERNAL void slabLayoutTagRun(void* ptr, void* end, int zero) {
+#ifndef MTELIB_NO_INLINE_ASSEMBLY
+    if (zero) {
+        memoryTagAndZeroLoop(ptr, end);
+    } else {
+        memoryTagLoop(ptr, end);
+    }
+#else
+    for (uint64_t* out = (uint64_t*)ptr; out < (uint64_t*)end; out += 2) {
+        __arm_mte_set_tag(out);
+        if (zero) {
+            out[0] = 0;
+            out[1] = 0;
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Give every slot of a slab a tag, and tag the whole slab in a single pass
+ *
+ * @param layout Layout of the slab
+ * @param slab Pointer (tagged or not) to the slab (must be aligned to tag boundary)
+ * @param tags Packed tag array receiving the slot tags (SLAB_LAYOUT_TAGS_SIZE(layout) bytes)
+ * @param zero Whether the slab should be zero'ed out while being tagged
+ * @note Each slot is tagged as a run of ST2G (and of a single STG if it spans an odd number of granules).
+ *       Redzones, the first granule and the tail of the slab that doesn't hold a slot are tagged with SLAB_LAYOUT_REDZONE_TAG.
+ */
+MTELIBEXPORT void slabLayoutTagSlab(const SlabLayout* layout, void* slab, uint8_t* tags, int zero) {
+    VERIFY_ALIGNMENT(slab, GRANULE_ALIGNMENT_MASK);
+    char* out = (char*)pointerSetTag(slab, 0);
+    char* const end = out + layout->slabSize;
+
+    //Slots only need to differ from their left neighbour here, as their right neighbour is tagged afterwards.
+    uint64_t previous = SLAB_LAYOUT_REDZONE_TAG;
+    for (size_t slot = 0; slot < layout->slotCount; slot++) {
+        if (slot == 0 || layout->redzones) {
+            slabLayoutTagRun(pointerSetTag(out, SLAB_LAYOUT_REDZONE_TAG), pointerSetTag(out + GRANULE_SIZE, SLAB_LAYOUT_REDZONE_TAG), zero);
+            out += GRANULE_SIZE;
+        }
+
+        const ExcludeMask mask = layout->redzones ? layout->excluded : excludeMaskAddTag(layout->excluded, previous);
+        char* const tagged = (char*)pointerSetTagFromSource(out, mask);
+        previous = pointerGetTag(tagged);
+        packedTagsSet(tags, slot, previous);
+        slabLayoutTagRun(tagged, tagged + layout->slotSize, zero);
+        out += layout->slotSize;
+    }
+
+    if (out < end) {
+        slabLayoutTagRun(pointerSetTag(out, SLAB_LAYOUT_REDZONE_TAG), pointerSetTag(end, SLAB_LAYOUT_REDZONE_TAG), zero);
+    }
+}
+
+/**
+ * @brief Get a tagged pointer to a slot
+ *
+ * @param layout Layout of the slab
+ * @param slab Pointer (tagged or not) to the slab
+ * @param tags Packed tag array of the slab
+ * @param slot Index of the slot
+ * @return Pointer to the slot, tagged with the slot's tag
+ */
+MTELIBEXPORT void* slabLayoutSlot(const SlabLayout* layout, void* slab, const uint8_t* tags, size_t slot) {
+    MTE_ASSERT(slot < layout->slotCount, "Slot index out of range");
+    char* const base = (char*)pointerSetTag(slab, 0);
+    return pointerSetTag(base + layout->firstSlot + slot * layout->stride, packedTagsGet(tags, slot));
+}
+
+/**
+ * @brief Get the index of the slot a pointer points into
+ *
+ * @param layout Layout of the slab
+ * @param slab Pointer (tagged or not) to the slab
+ * @param ptr Pointer (tagged or not) into a slot of the slab
+ * @return Index of the slot
+ */
+MTELIBEXPORT size_t slabLayoutSlotIndex(const SlabLayout* layout, void* slab, void* ptr) {
+    const uintptr_t offset = (uintptr_t)pointerSetTag(ptr, 0) - (uintptr_t)pointerSetTag(slab, 0);
+    MTE_ASSERT((offset >= layout->firstSlot && offset < layout->firstSlot + layout->slotCount * layout->stride), "Pointer doesn't belong to a slot");
+    return (offset - layout->firstSlot) / layout->stride;
+}
+
+/**
+ * @brief Give a slot a new tag, different from its current one (and from those of its neighbours without redzones)
+ *
+ * @param layout Layout of the slab
+ * @param slab Pointer (tagged or not) to the slab
+ * @param tags Packed tag array of the slab, updated with the new tag
+ * @param slot Index of the slot
+ * @param zero Whether the slot should be zero'ed out while being retagged
+ * @return Pointer to the slot, tagged with its new tag
+ */
+MTELIBEXPORT void* slabLayoutRetagSlot(const SlabLayout* layout, void* slab, uint8_t* tags, size_t slot, int zero) {
+    void* const tagged = pointerSetTagFromSource(slabLayoutSlot(layout, slab, tags, slot), slabLayoutSlotExcludeMask(layout, tags, slot));
+    packedTagsSet(tags, slot, pointerGetTag(tagged));
+    if (zero) {
+        memoryTagAndZero(tagged, layout->slotSize);
+    } else {
+        memoryTag(tagged, layout->slotSize);
+    }
+    return tagged;
+}
+
+#endif //MTELIB_LAYOUT_H
@@ -0,0 +1,168 @@
+/**
+ * @file mtelib_mode.h
+ * @author CreepNT
+ * @brief Selection of the tag check fault mode of the calling thread
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Modes are thread-local (prctl(PR_SET_TAGGED_ADDR_CTRL) only affects the calling thread).
+ *       Threads created afterwards inherit the mode of their creator.
+ */
+
+#ifndef MTELIB_MODE_H
+#define MTELIB_MODE_H
+
+#include "mtelib.h"
+
+#include <stdio.h>  //fopen, fgets, snprintf
+#include <string.h> //strncmp
+
+#include <sys/prctl.h>
+
+#ifndef PR_SET_TAGGED_ADDR_CTRL
+    #define PR_SET_TAGGED_ADDR_CTRL (55)
+    #define PR_GET_TAGGED_ADDR_CTRL (56)
+    #define PR_TAGGED_ADDR_ENABLE   (1UL << 0)
+#endif
+
+#ifndef PR_MTE_TCF_SHIFT
+    #define PR_MTE_TCF_SHIFT (1)
+    #define PR_MTE_TCF_NONE  (0UL << PR_MTE_TCF_SHIFT)
+    #define PR_MTE_TCF_SYNC  (1UL << PR_MTE_TCF_SHIFT)
+    #define PR_MTE_TCF_ASYNC (2UL << PR_MTE_TCF_SHIFT)
+    #define PR_MTE_TCF_MASK  (3UL << PR_MTE_TCF_SHIFT)
+#endif
+
+#ifndef PR_MTE_TAG_SHIFT
+    #define PR_MTE_TAG_SHIFT (3)
+    #define PR_MTE_TAG_MASK  (0xFFFFUL << PR_MTE_TAG_SHIFT)
+#endif
+
+typedef enum MTEMode {
+    MTE_MODE_NONE,  //Tag checks don't fault
+    MTE_MODE_SYNC,  //Faults are reported on the faulting instruction
+    MTE_MODE_ASYNC, //Faults are reported on next kernel entry, without the faulting address
+    MTE_MODE_ASYMM, //Synchronous for loads, asynchronous for stores (FEAT_MTE3)
+} MTEMode;
+
+//ASYMM can't be requested directly: when both SYNC and ASYNC are requested, the kernel uses the
+//mode preferred by the CPU (mte_tcf_preferred), which is how asymmetric mode gets selected.
+MTELIBINTERNAL unsigned long mteModeToTCF(MTEMode mode) {
+    switch (mode) {
+    case MTE_MODE_SYNC:  return PR_MTE_TCF_SYNC;
+    case MTE_MODE_ASYNC: return PR_MTE_TCF_ASYNC;
+    case MTE_MODE_ASYMM: return PR_MTE_TCF_SYNC | PR_MTE_TCF_ASYNC;
+    default:             return PR_MTE_TCF_NONE;
+    }
+}
+
+/**
+ * @brief Get the tag check fault mode preferred by the kernel on a CPU
+ *
+ * @param cpu CPU to query
+ * @return Mode read from /sys/devices/system/cpu/cpu<cpu>/mte_tcf_preferred, or MTE_MODE_NONE if unavailable
+ */
+MTELIBEXPORT MTEMode mteModeGetPreferred(unsigned cpu) {
+    char path[80];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/mte_tcf_preferred", cpu);
+    FILE* const f = fopen(path, "r");
+    if (f == NULL) {
+        return MTE_MODE_NONE;
+    }
+
+    char value[16] = {0};
+    MTEMode mode = MTE_MODE_NONE;
+    if (fgets(value, sizeof(value), f) != NULL) {
+        if (strncmp(value, "sync", 4) == 0) {
+            mode = MTE_MODE_SYNC;
+        } else if (strncmp(value, "async", 5) == 0) {
+            mode = MTE_MODE_ASYNC;
+        } else if (strncmp(value, "asymm", 5) == 0) {
+            mode = MTE_MODE_ASYMM;
+        }
+    }
+    fclose(f);
+    return mode;
+}
+
+/**
+ * @brief Enable tagged addresses and set the tag check fault mode of the calling thread
+ *
+ * @param mode Tag check fault mode
+ * @param excluded Tags IRG must never generate (GCR_EL1.Exclude)
+ * @return 0 on success, -1 on failure (errno is set by prctl)
+ * @note For MTE_MODE_ASYMM, the kernel falls back to the CPU's preferred mode if it isn't asymm.
+ */
+MTELIBEXPORT int mteModeSet(MTEMode mode, ExcludeMask excluded) {
+    const unsigned long include = (~excluded & 0xFFFFUL) << PR_MTE_TAG_SHIFT;
+    return (prctl(PR_SET_TAGGED_ADDR_CTRL, PR_TAGGED_ADDR_ENABLE | mteModeToTCF(mode) | include, 0, 0, 0) < 0) ? -1 : 0;
+}
+
+/**
+ * @brief Get the tag check fault mode of the calling thread
+ *
+ * @param mode Receives the tag check fault mode
+ * @param excluded Receives the tags IRG never generates (may be NULL)
+ * @return 0 on success, -1 on failure (errno is set by prctl)
+ */
+MTELIBEXPORT int mteModeGet(MTEMode* mode, ExcludeMask* excluded) {
+    const int ctrl = prctl(PR_GET_TAGGED_ADDR_CTRL, 0, 0, 0, 0);
+    if (ctrl < 0) {
+        return -1;
+    }
+
+    switch ((unsigned long)ctrl & PR_MTE_TCF_MASK) {
+    case PR_MTE_TCF_SYNC:                    *mode = MTE_MODE_SYNC; break;
+    case PR_MTE_TCF_ASYNC:                   *mode = MTE_MODE_ASYNC; break;
+    case PR_MTE_TCF_SYNC | PR_MTE_TCF_ASYNC: *mode = MTE_MODE_ASYMM; break;
+    default:                                 *mode = MTE_MODE_NONE; break;
+    }
+    if (excluded != NULL) {
+        *excluded = ~(((unsigned long)ctrl & PR_MTE_TAG_MASK) >> PR_MTE_TAG_SHIFT) & 0xFFFFUL;
+    }
+    return 0;
+}
+
+/* Scoped mode switches */
+typedef struct MTEModeScope {
+    int previous; //Value of PR_GET_TAGGED_ADDR_CTRL before the switch, or -1 if there is nothing to restore
+} MTEModeScope;
+
+/**
+ * @brief Switch the calling thread to another tag check fault mode, until mteModeScopeExit
+ *
+ * @param scope Receives the state to restore
+ * @param mode Tag check fault mode used inside the scope
+ * @return 0 on success, -1 on failure (errno is set by prctl)
+ * @note The exclude mask is kept as is. Scopes may be nested, and must be exited in reverse order.
+ */
+MTELIBEXPORT int mteModeScopeEnter(MTEModeScope* scope, MTEMode mode) {
+    scope->previous = prctl(PR_GET_TAGGED_ADDR_CTRL, 0, 0, 0, 0);
+    if (scope->previous < 0) {
+        return -1;
+    }
+
+    const unsigned long ctrl = ((unsigned long)scope->previous & ~PR_MTE_TCF_MASK) | PR_TAGGED_ADDR_ENABLE | mteModeToTCF(mode);
+    if ((unsigned long)scope->previous == ctrl) {
+        scope->previous = -1; //Already in that mode, nothing to restore
+        return 0;
+    }
+    if (prctl(PR_SET_TAGGED_ADDR_CTRL, ctrl, 0, 0, 0) < 0) {
+        scope->previous = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Switch the calling thread back to the mode it used before mteModeScopeEnter
+ *
+ * @param scope State saved by mteModeScopeEnter
+ */
+MTELIBEXPORT void mteModeScopeExit(MTEModeScope* scope) {
+    if (scope->previous >= 0) {
+        prctl(PR_SET_TAGGED_ADDR_CTRL, (unsigned long)scope->previous, 0, 0, 0);
+        scope->previous = -1;
+    }
+}
+
+#endif //MTELIB_MODE_H
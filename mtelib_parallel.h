@@ -0,0 +1,287 @@
+/**
+ * @file mtelib_parallel.h
+ * @author CreepNT
+ * @brief Multi-threaded memoryTag/memoryTagAndZero for very large areas
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Areas are split on page boundaries (which are also DC GVA block boundaries), and the parts are
+ *       handed to an executor: either the worker pool of this file, or one provided by the caller.
+ */
+
+#ifndef MTELIB_PARALLEL_H
+#define MTELIB_PARALLEL_H
+
+#include "mtelib.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint64_t, uintptr_t
+#include <string.h> //memset
+#include <unistd.h> //sysconf
+
+/* Configuration options */
+//MTELIB_PARALLEL_THRESHOLD: minimum size (in bytes) of an area for it to be tagged in parallel.
+//MTELIB_PARALLEL_MAX_WORKERS: largest number of threads of a worker pool.
+
+#ifndef MTELIB_PARALLEL_THRESHOLD
+    #define MTELIB_PARALLEL_THRESHOLD (32U << 20)
+#endif
+
+#ifndef MTELIB_PARALLEL_MAX_WORKERS
+    #define MTELIB_PARALLEL_MAX_WORKERS (64U)
+#endif
+
+//Task run by an executor, index goes from 0 to count - 1.
+typedef void (*ParallelTask)(void* arg, unsigned index);
+
+typedef struct ParallelExecutor {
+    //Run task(arg, i) for every i below count, returning once all of them are done.
+    void (*run)(void* context, ParallelTask task, void* arg, unsigned count);
+    void* context;
+    unsigned concurrency; //Number of tasks that can run at once, areas are split in that many parts
+} ParallelExecutor;
+
+typedef struct ParallelPool {
+    pthread_t threads[MTELIB_PARALLEL_MAX_WORKERS];
+    unsigned workers;
+
+    pthread_mutex_t runLock;    //Serializes callers of parallelPoolRun
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t generation;        //Incremented each time workers are handed new tasks
+    unsigned idleWorkers;       //Workers done with the current generation
+    int stop;
+
+    ParallelTask task;
+    void* arg;
+    unsigned count;
+    _Atomic unsigned nextIndex;
+} ParallelPool;
+
+//Run tasks of the current generation until none are left
+MTELIBINTERNAL void parallelPoolRunTasks(ParallelPool* pool) {
+    for (;;) {
+        const unsigned index = atomic_fetch_add_explicit(&pool->nextIndex, 1, memory_order_relaxed);
+        if (index >= pool->count) {
+            return;
+        }
+        pool->task(pool->arg, index);
+    }
+}
+
+MTELIBINTERNAL void* parallelPoolWorkerMain(void* arg) {
+    ParallelPool* const pool = (ParallelPool*)arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->stop) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        parallelPoolRunTasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->idleWorkers == pool->workers) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+MTELIBINTERNAL void parallelPoolStop(ParallelPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+/**
+ * @brief Stop the threads of a worker pool
+ *
+ * @param pool Pool to destroy
+ */
+MTELIBEXPORT void parallelPoolDestroy(ParallelPool* pool) {
+    parallelPoolStop(pool);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->runLock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Start a worker pool
+ *
+ * @param pool Pool to initialize
+ * @param workers Number of worker threads, 0 for one per online CPU minus the calling thread (capped to MTELIB_PARALLEL_MAX_WORKERS)
+ * @return 0 on success, -1 on failure (errno is set to the error returned by pthread_create)
+ * @note The thread running tasks through the pool takes part in them, so it runs up to workers + 1 tasks at once.
+ */
+MTELIBEXPORT int parallelPoolInit(ParallelPool* pool, unsigned workers) {
+    memset(pool, 0, sizeof(*pool));
+    if (workers == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 1) ? (unsigned)(cpus - 1) : 0;
+    }
+    if (workers > MTELIB_PARALLEL_MAX_WORKERS) {
+        workers = MTELIB_PARALLEL_MAX_WORKERS;
+    }
+
+    pthread_mutex_init(&pool->runLock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->nextIndex, 0);
+
+    for (unsigned i = 0; i < workers; i++) {
+        const int error = pthread_create(&pool->threads[i], NULL, parallelPoolWorkerMain, pool);
+        if (error != 0) {
+            parallelPoolDestroy(pool);
+            errno = error;
+            return -1;
+        }
+        pool->workers++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Run tasks on a worker pool and the calling thread
+ *
+ * @param context ParallelPool to run the tasks on
+ * @param task Task to run
+ * @param arg Argument given to the task
+ * @param count Number of times the task is run
+ */
+MTELIBEXPORT void parallelPoolRun(void* context, ParallelTask task, void* arg, unsigned count) {
+    ParallelPool* const pool = (ParallelPool*)context;
+    pthread_mutex_lock(&pool->runLock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->count = count;
+    atomic_store_explicit(&pool->nextIndex, 0, memory_order_relaxed);
+    pool->idleWorkers = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    parallelPoolRunTasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idleWorkers != pool->workers) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->runLock);
+}
+
+/**
+ * @brief Get an executor running tasks on a worker pool
+ *
+ * @param pool Pool the tasks are run on
+ * @return Executor, valid until the pool is destroyed
+ */
+MTELIBEXPORT ParallelExecutor parallelPoolExecutor(ParallelPool* pool) {
+    ParallelExecutor executor = { parallelPoolRun, pool, pool->workers + 1 };
+    return executor;
+}
+
+typedef struct ParallelTagJob {
+    char* start;        //Tagged
+    char* end;          //Tagged
+    size_t partSize;    //Size of each part (before alignment to page boundary)
+    size_t pageMask;
+    int zero;
+} ParallelTagJob;
+
+//Parts start on page boundaries, except the first which starts at the beginning of the area.
+MTELIBINTERNAL char* parallelTagJobBoundary(const ParallelTagJob* job, unsigned index) {
+    if (index == 0) {
+        return job->start;
+    }
+    const uintptr_t boundary = ((uintptr_t)job->start + (uintptr_t)index * job->partSize + job->pageMask) & ~(uintptr_t)job->pageMask;
+    return (boundary < (uintptr_t)job->end) ? (char*)boundary : job->end;
+}
+
+MTELIBINTERNAL void parallelTagTask(void* arg, unsigned index) {
+    const ParallelTagJob* const job = (const ParallelTagJob*)arg;
+    char* const start = parallelTagJobBoundary(job, index);
+    char* const end = parallelTagJobBoundary(job, index + 1);
+    if (start == end) {
+        return;
+    }
+    if (job->zero) {
+        memoryTagAndZero(start, (size_t)(end - start));
+    } else {
+        memoryTag(start, (size_t)(end - start));
+    }
+}
+
+MTELIBINTERNAL void parallelTag(void* ptr, size_t size, const ParallelExecutor* executor, int zero) {
+    if (executor == NULL || executor->concurrency <= 1 || size < MTELIB_PARALLEL_THRESHOLD) {
+        if (zero) {
+            memoryTagAndZero(ptr, size);
+        } else {
+            memoryTag(ptr, size);
+        }
+        return;
+    }
+
+    //Cheap next to tagging MTELIB_PARALLEL_THRESHOLD bytes, and not cached, so that threads don't race on the cache.
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+    ParallelTagJob job;
+    job.start = (char*)ptr;
+    job.end = (char*)ptr + size;
+    job.partSize = (size + executor->concurrency - 1) / executor->concurrency;
+    job.pageMask = pageSize - 1;
+    job.zero = zero;
+    executor->run(executor->context, parallelTagTask, &job, executor->concurrency);
+}
+
+/**
+ * @brief Tag an area of memory using several threads
+ *
+ * @param ptr Tagged pointer to area that gets tagged with the tag in ptr itself
+ * @param size Size of the area to tag (must be aligned to tag boundary)
+ * @param executor Executor running the parts, NULL to tag inline
+ * @note Areas smaller than MTELIB_PARALLEL_THRESHOLD are tagged inline.
+ */
+MTELIBEXPORT void parallelMemoryTag(void* ptr, size_t size, const ParallelExecutor* executor) {
+    VERIFY_ALIGNMENT(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT(size, GRANULE_ALIGNMENT_MASK);
+    parallelTag(ptr, size, executor, 0);
+}
+
+/**
+ * @brief bzero while tagging an area of memory using several threads
+ *
+ * @param ptr Tagged pointer to area that gets zero'ed out and tagged
+ * @param size Size of the area to zero out (must be aligned to tag boundary)
+ * @param executor Executor running the parts, NULL to tag inline
+ * @note Areas smaller than MTELIB_PARALLEL_THRESHOLD are tagged inline.
+ */
+MTELIBEXPORT void parallelMemoryTagAndZero(void* ptr, size_t size, const ParallelExecutor* executor) {
+    //Same as memoryTagAndZero: misaligned areas would make the kernels fault or zero the wrong bytes.
+    VERIFY_ALIGNMENT_CRITICAL(ptr, GRANULE_ALIGNMENT_MASK);
+    VERIFY_ALIGNMENT_CRITICAL(size, GRANULE_ALIGNMENT_MASK);
+    parallelTag(ptr, size, executor, 1);
+}
+
+#endif //MTELIB_PARALLEL_H
@@ -0,0 +1,386 @@
+/**
+ * @file mtelib_pool.h
+ * @author CreepNT
+ * @brief Thread-safe tagged memory pool with per-thread caches, built on mtelib_arena.h
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Each thread allocates and frees through its own cache, acquired with taggedPoolAcquireCache.
+ *       Caches exchange chunks with the shared pool in lock-free batches, and chunks freed by another
+ *       thread than the one owning their slab are sent back to the owner's cache without locking.
+ */
+
+#ifndef MTELIB_POOL_H
+#define MTELIB_POOL_H
+
+#include "mtelib.h"
+#include "mtelib_arena.h"
+
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint16_t, uint32_t, uint64_t
+#include <string.h> //memcpy, memset
+
+#include <sys/mman.h>
+
+/* Configuration options */
+//TAGGED_POOL_BATCH_SIZE: number of chunks moved at once between thread caches and the shared pool.
+//TAGGED_POOL_NUM_BATCHES: number of transfer batches available in the shared pool.
+//TAGGED_POOL_MAX_CACHES: maximum number of thread caches of a pool.
+
+#ifndef TAGGED_POOL_BATCH_SIZE
+    #define TAGGED_POOL_BATCH_SIZE (32U)
+#endif
+
+#ifndef TAGGED_POOL_NUM_BATCHES
+    #define TAGGED_POOL_NUM_BATCHES (4096U)
+#endif
+
+#ifndef TAGGED_POOL_MAX_CACHES
+    #define TAGGED_POOL_MAX_CACHES (256U)
+#endif
+
+#define TAGGED_POOL_CACHE_CAPACITY (2U * TAGGED_POOL_BATCH_SIZE)
+#define TAGGED_POOL_NO_BATCH       (0xFFFFFFFFU)
+#define TAGGED_POOL_CACHE_LINE     (64U)
+
+static_assert(TAGGED_POOL_NUM_BATCHES < TAGGED_POOL_NO_BATCH, "Too many transfer batches");
+static_assert(TAGGED_POOL_MAX_CACHES <= 0x10000U, "Too many thread caches");
+
+//Batch stacks heads hold an ABA counter in the upper 32 bits, and a batch index in the lower 32 bits.
+typedef _Atomic uint64_t TaggedPoolBatchStack;
+
+typedef struct TaggedPoolBatch {
+    _Atomic uint32_t next;  //Index of the next batch in the stack it belongs to
+    uint32_t count;
+    void* chunks[TAGGED_POOL_BATCH_SIZE]; //Tagged pointers to retagged and zero'ed chunks
+} TaggedPoolBatch;
+
+typedef struct TaggedPoolCacheClass {
+    uint32_t count;
+    void* chunks[TAGGED_POOL_CACHE_CAPACITY]; //Tagged pointers to retagged and zero'ed chunks
+    TaggedArenaFreeChunk* overflow;           //Used when no transfer batch is available
+    char* bump;                               //Untagged, next never-used chunk in the current slab
+    char* bumpEnd;                            //Untagged, end of the current slab
+    uint64_t lastTag;                         //Tag of the last chunk carved from the current slab
+} TaggedPoolCacheClass;
+
+typedef struct TaggedPoolCache {
+    //Written by other threads, kept on its own cache line.
+    _Alignas(TAGGED_POOL_CACHE_LINE) _Atomic(TaggedArenaFreeChunk*) remoteFrees;
+
+    _Alignas(TAGGED_POOL_CACHE_LINE) struct TaggedPool* pool;
+    _Atomic uint32_t inUse;
+    uint16_t id;
+    TaggedPoolCacheClass classes[TAGGED_ARENA_NUM_CLASSES];
+} TaggedPoolCache;
+
+typedef struct TaggedPoolClass {
+    _Alignas(TAGGED_POOL_CACHE_LINE) TaggedPoolBatchStack fullBatches;
+} TaggedPoolClass;
+
+typedef struct TaggedPool {
+    char* base;             //Untagged base of the PROT_MTE reservation
+    size_t size;            //Size of the reservation
+    ExcludeMask excluded;   //Tags never given to chunks (always contains TAGGED_ARENA_FREE_TAG)
+    uint8_t* slabClasses;   //Size class of each slab, or TAGGED_ARENA_NO_CLASS
+    uint16_t* slabOwners;   //Id of the cache owning each slab
+    TaggedPoolBatch* batches;
+
+    _Alignas(TAGGED_POOL_CACHE_LINE) _Atomic size_t used; //Bytes of the reservation handed out to caches
+    _Alignas(TAGGED_POOL_CACHE_LINE) TaggedPoolBatchStack freeBatches;
+    _Alignas(TAGGED_POOL_CACHE_LINE) _Atomic uint32_t numCaches;
+    TaggedPoolCache* _Atomic caches[TAGGED_POOL_MAX_CACHES];
+    TaggedPoolClass classes[TAGGED_ARENA_NUM_CLASSES];
+} TaggedPool;
+
+MTELIBINTERNAL void taggedPoolBatchPush(TaggedPool* pool, TaggedPoolBatchStack* stack, uint32_t index) {
+    uint64_t head = atomic_load_explicit(stack, memory_order_relaxed);
+    uint64_t newHead;
+    do {
+        atomic_store_explicit(&pool->batches[index].next, (uint32_t)head, memory_order_relaxed);
+        newHead = ((head & ~0xFFFFFFFFULL) + (1ULL << 32)) | index;
+    } while (!atomic_compare_exchange_weak_explicit(stack, &head, newHead, memory_order_release, memory_order_relaxed));
+}
+
+MTELIBINTERNAL uint32_t taggedPoolBatchPop(TaggedPool* pool, TaggedPoolBatchStack* stack) {
+    uint64_t head = atomic_load_explicit(stack, memory_order_acquire);
+    uint64_t newHead;
+    uint32_t index;
+    do {
+        index = (uint32_t)head;
+        if (index == TAGGED_POOL_NO_BATCH) {
+            return TAGGED_POOL_NO_BATCH;
+        }
+        //Batches are never unmapped while the pool lives, so reading a batch popped by another thread is harmless:
+        //the ABA counter makes the exchange fail in that case.
+        const uint32_t next = atomic_load_explicit(&pool->batches[index].next, memory_order_relaxed);
+        newHead = ((head & ~0xFFFFFFFFULL) + (1ULL << 32)) | next;
+    } while (!atomic_compare_exchange_weak_explicit(stack, &head, newHead, memory_order_acquire, memory_order_acquire));
+    return index;
+}
+
+/**
+ * @brief Reserve a PROT_MTE mapping to be shared by threads
+ *
+ * @param pool Pool to initialize
+ * @param size Size of the reservation (rounded up to slab size)
+ * @param excluded Tags that must never be given to chunks
+ * @return 0 on success, -1 on failure (errno is set by mmap)
+ * @note The pool itself must not be used by several threads until this returns.
+ */
+MTELIBEXPORT int taggedPoolInit(TaggedPool* pool, size_t size, ExcludeMask excluded) {
+    size = (size + TAGGED_ARENA_SLAB_SIZE - 1) & ~(TAGGED_ARENA_SLAB_SIZE - 1);
+    memset(pool, 0, sizeof(*pool));
+
+    const size_t numSlabs = size >> TAGGED_ARENA_LOG2_SLAB_SIZE;
+    const size_t metadataSize = numSlabs * (sizeof(uint8_t) + sizeof(uint16_t)) + TAGGED_POOL_NUM_BATCHES * sizeof(TaggedPoolBatch);
+    char* metadata = (char*)mmap(NULL, metadataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (metadata == MAP_FAILED) {
+        return -1;
+    }
+
+    void* base = mmap(NULL, size, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        munmap(metadata, metadataSize);
+        return -1;
+    }
+
+    pool->base = (char*)base;
+    pool->size = size;
+    pool->excluded = excludeMaskAddTag(excluded, TAGGED_ARENA_FREE_TAG);
+    pool->batches = (TaggedPoolBatch*)metadata;
+    pool->slabOwners = (uint16_t*)(metadata + TAGGED_POOL_NUM_BATCHES * sizeof(TaggedPoolBatch));
+    pool->slabClasses = (uint8_t*)(pool->slabOwners + numSlabs);
+    memset(pool->slabClasses, TAGGED_ARENA_NO_CLASS, numSlabs);
+
+    atomic_init(&pool->used, 0);
+    atomic_init(&pool->numCaches, 0);
+    atomic_init(&pool->freeBatches, TAGGED_POOL_NO_BATCH);
+    for (size_t i = 0; i < TAGGED_ARENA_NUM_CLASSES; i++) {
+        atomic_init(&pool->classes[i].fullBatches, TAGGED_POOL_NO_BATCH);
+    }
+    for (uint32_t i = 0; i < TAGGED_POOL_NUM_BATCHES; i++) {
+        taggedPoolBatchPush(pool, &pool->freeBatches, i);
+    }
+    return 0;
+}
+
+/**
+ * @brief Release the memory reserved by a pool, and all its caches
+ *
+ * @param pool Pool to destroy
+ * @note No thread may use the pool or any of its caches anymore.
+ */
+MTELIBEXPORT void taggedPoolDestroy(TaggedPool* pool) {
+    const uint32_t numCaches = atomic_load(&pool->numCaches);
+    for (uint32_t i = 0; i < numCaches; i++) {
+        TaggedPoolCache* const cache = atomic_load(&pool->caches[i]);
+        if (cache != NULL) {
+            munmap(cache, sizeof(TaggedPoolCache));
+        }
+    }
+
+    const size_t numSlabs = pool->size >> TAGGED_ARENA_LOG2_SLAB_SIZE;
+    munmap(pool->batches, numSlabs * (sizeof(uint8_t) + sizeof(uint16_t)) + TAGGED_POOL_NUM_BATCHES * sizeof(TaggedPoolBatch));
+    munmap(pool->base, pool->size);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Get a cache for the calling thread
+ *
+ * @param pool Pool to get a cache from
+ * @return Cache to use for all allocations and frees of the calling thread, or NULL on failure
+ * @note Caches released by exited threads are reused, along with the chunks they hold.
+ */
+MTELIBEXPORT TaggedPoolCache* taggedPoolAcquireCache(TaggedPool* pool) {
+    uint32_t numCaches = atomic_load_explicit(&pool->numCaches, memory_order_acquire);
+    for (uint32_t i = 0; i < numCaches; i++) {
+        TaggedPoolCache* const cache = atomic_load_explicit(&pool->caches[i], memory_order_acquire);
+        uint32_t expected = 0;
+        if (cache != NULL && atomic_compare_exchange_strong_explicit(&cache->inUse, &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+            return cache;
+        }
+    }
+
+    const uint32_t id = atomic_fetch_add_explicit(&pool->numCaches, 1, memory_order_relaxed);
+    if (id >= TAGGED_POOL_MAX_CACHES) {
+        atomic_fetch_sub_explicit(&pool->numCaches, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    TaggedPoolCache* cache = (TaggedPoolCache*)mmap(NULL, sizeof(TaggedPoolCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        //Leave a hole in the cache list rather than racing with other threads to shrink it.
+        return NULL;
+    }
+
+    cache->pool = pool;
+    cache->id = (uint16_t)id;
+    atomic_init(&cache->remoteFrees, NULL);
+    atomic_init(&cache->inUse, 1);
+    atomic_store_explicit(&pool->caches[id], cache, memory_order_release);
+    return cache;
+}
+
+/**
+ * @brief Give back a cache when its thread exits
+ *
+ * @param cache Cache acquired with taggedPoolAcquireCache
+ * @note The cache keeps its chunks and slabs, and keeps receiving remote frees until another thread acquires it.
+ */
+MTELIBEXPORT void taggedPoolReleaseCache(TaggedPoolCache* cache) {
+    atomic_store_explicit(&cache->inUse, 0, memory_order_release);
+}
+
+//Move a batch of chunks from the cache to the shared pool, or to the overflow list if no batch is available.
+MTELIBINTERNAL void taggedPoolCacheDrain(TaggedPoolCache* cache, TaggedPoolCacheClass* cc, size_t classIndex) {
+    TaggedPool* const pool = cache->pool;
+    const uint32_t index = taggedPoolBatchPop(pool, &pool->freeBatches);
+    if (index != TAGGED_POOL_NO_BATCH) {
+        TaggedPoolBatch* const batch = &pool->batches[index];
+        cc->count -= TAGGED_POOL_BATCH_SIZE;
+        memcpy(batch->chunks, &cc->chunks[cc->count], sizeof(batch->chunks));
+        batch->count = TAGGED_POOL_BATCH_SIZE;
+        taggedPoolBatchPush(pool, &pool->classes[classIndex].fullBatches, index);
+        return;
+    }
+
+    while (cc->count > TAGGED_POOL_BATCH_SIZE) {
+        TaggedArenaFreeChunk* const chunk = (TaggedArenaFreeChunk*)cc->chunks[--cc->count];
+        chunk->next = cc->overflow;
+        cc->overflow = chunk;
+    }
+}
+
+//Take back chunks freed by other threads.
+MTELIBINTERNAL void taggedPoolCacheCollectRemoteFrees(TaggedPoolCache* cache) {
+    TaggedArenaFreeChunk* chunk = atomic_exchange_explicit(&cache->remoteFrees, NULL, memory_order_acquire);
+    while (chunk != NULL) {
+        TaggedArenaFreeChunk* const next = chunk->next;
+        const uintptr_t offset = (uintptr_t)pointerSetTag(chunk, 0) - (uintptr_t)cache->pool->base;
+        TaggedPoolCacheClass* const cc = &cache->classes[cache->pool->slabClasses[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE]];
+        chunk->next = cc->overflow;
+        cc->overflow = chunk;
+        chunk = next;
+    }
+}
+
+//Refill an empty cache class, returns a chunk or NULL if the pool is exhausted.
+MTELIBINTERNAL void* taggedPoolCacheRefill(TaggedPoolCache* cache, TaggedPoolCacheClass* cc, size_t classIndex) {
+    TaggedPool* const pool = cache->pool;
+
+    if (cc->overflow == NULL) {
+        taggedPoolCacheCollectRemoteFrees(cache);
+    }
+    if (cc->overflow != NULL) {
+        TaggedArenaFreeChunk* const chunk = cc->overflow;
+        cc->overflow = chunk->next;
+        return chunk;
+    }
+
+    const uint32_t index = taggedPoolBatchPop(pool, &pool->classes[classIndex].fullBatches);
+    if (index != TAGGED_POOL_NO_BATCH) {
+        TaggedPoolBatch* const batch = &pool->batches[index];
+        cc->count = batch->count - 1;
+        memcpy(cc->chunks, batch->chunks, cc->count * sizeof(void*));
+        void* const chunk = batch->chunks[cc->count];
+        taggedPoolBatchPush(pool, &pool->freeBatches, index);
+        return chunk;
+    }
+
+    const size_t classSize = taggedArenaClassSize(classIndex);
+    if ((size_t)(cc->bumpEnd - cc->bump) < classSize) {
+        const size_t offset = atomic_fetch_add_explicit(&pool->used, TAGGED_ARENA_SLAB_SIZE, memory_order_relaxed);
+        if (offset + TAGGED_ARENA_SLAB_SIZE > pool->size) {
+            atomic_fetch_sub_explicit(&pool->used, TAGGED_ARENA_SLAB_SIZE, memory_order_relaxed);
+            return NULL;
+        }
+        cc->bump = pool->base + offset;
+        cc->bumpEnd = cc->bump + TAGGED_ARENA_SLAB_SIZE;
+        pool->slabOwners[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE] = cache->id;
+        pool->slabClasses[offset >> TAGGED_ARENA_LOG2_SLAB_SIZE] = (uint8_t)classIndex;
+    }
+
+    void* ptr = pointerSetTagFromSource(cc->bump, excludeMaskAddTag(pool->excluded, cc->lastTag));
+    cc->lastTag = pointerGetTag(ptr);
+    memoryTag(ptr, classSize);
+    cc->bump += classSize;
+    return ptr;
+}
+
+/**
+ * @brief Allocate a zero'ed, tagged chunk through a thread cache
+ *
+ * @param cache Cache of the calling thread
+ * @param size Size of the allocation (at most TAGGED_ARENA_MAX_SIZE)
+ * @return Tagged pointer to a granule-aligned chunk, or NULL if the pool is exhausted
+ */
+MTELIBEXPORT void* taggedPoolAlloc(TaggedPoolCache* cache, size_t size) {
+    MTE_ASSERT(size <= TAGGED_ARENA_MAX_SIZE, "Allocation too large for pool");
+
+    const size_t classIndex = taggedArenaClassIndex(size);
+    TaggedPoolCacheClass* const cc = &cache->classes[classIndex];
+
+    void* chunk;
+    if (cc->count != 0) {
+        chunk = cc->chunks[--cc->count];
+    } else {
+        chunk = taggedPoolCacheRefill(cache, cc, classIndex);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    //Chunks that went through a free list still hold a link in their first word.
+    ((TaggedArenaFreeChunk*)chunk)->next = NULL;
+    return chunk;
+}
+
+/**
+ * @brief Return a chunk to the pool through a thread cache
+ *
+ * @param cache Cache of the calling thread
+ * @param ptr Tagged pointer returned by taggedPoolAlloc (NULL is ignored)
+ * @note The chunk is zero'ed and retagged with a different tag, then goes back to the cache owning its slab.
+ */
+MTELIBEXPORT void taggedPoolFree(TaggedPoolCache* cache, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    TaggedPool* const pool = cache->pool;
+    const uintptr_t offset = (uintptr_t)pointerSetTag(ptr, 0) - (uintptr_t)pool->base;
+    MTE_ASSERT(offset < atomic_load_explicit(&pool->used, memory_order_relaxed), "Pointer doesn't belong to pool");
+
+    const size_t slab = offset >> TAGGED_ARENA_LOG2_SLAB_SIZE;
+    const size_t classIndex = pool->slabClasses[slab];
+    MTE_ASSERT(classIndex != TAGGED_ARENA_NO_CLASS, "Pointer doesn't belong to a slab");
+    const size_t classSize = taggedArenaClassSize(classIndex);
+    MTE_ASSERT((offset & (TAGGED_ARENA_SLAB_SIZE - 1)) % classSize == 0, "Pointer isn't the start of a chunk");
+
+    //Tag stores aren't tag-checked: go through a checked load first so that double frees fault.
+    (void)*(volatile char*)ptr;
+
+    void* const chunk = pointerSetTagFromSource(ptr, excludeMaskAddPtrTag(pool->excluded, ptr));
+    memoryTagAndZero(chunk, classSize);
+
+    const uint16_t owner = pool->slabOwners[slab];
+    if (owner != cache->id) {
+        TaggedPoolCache* const ownerCache = atomic_load_explicit(&pool->caches[owner], memory_order_relaxed);
+        TaggedArenaFreeChunk* const remote = (TaggedArenaFreeChunk*)chunk;
+        TaggedArenaFreeChunk* head = atomic_load_explicit(&ownerCache->remoteFrees, memory_order_relaxed);
+        do {
+            remote->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&ownerCache->remoteFrees, &head, remote, memory_order_release, memory_order_relaxed));
+        return;
+    }
+
+    TaggedPoolCacheClass* const cc = &cache->classes[classIndex];
+    if (cc->count == TAGGED_POOL_CACHE_CAPACITY) {
+        taggedPoolCacheDrain(cache, cc, classIndex);
+    }
+    cc->chunks[cc->count++] = chunk;
+}
+
+#endif //MTELIB_POOL_H
@@ -0,0 +1,266 @@
+/**
+ * @file mtelib_region.h
+ * @author CreepNT
+ * @brief Reservation of large PROT_MTE regions backed by huge pages, bound to a NUMA node
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Regions are backed by hugetlb pages when possible, otherwise by transparent huge pages.
+ *       Tagging a region first-touches it from threads pinned to the region's node, so that pages
+ *       (and their tag storage) are allocated there. libnuma isn't needed: mbind and sched_setaffinity are called directly.
+ */
+
+#ifndef MTELIB_REGION_H
+#define MTELIB_REGION_H
+
+#include "mtelib.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uintptr_t
+#include <stdio.h>  //fopen, fscanf, snprintf
+#include <string.h> //memset
+#include <unistd.h> //syscall, sysconf
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef PROT_MTE
+    #define PROT_MTE (0x20)
+#endif
+
+#ifndef MAP_HUGETLB
+    #define MAP_HUGETLB (0x40000)
+#endif
+
+#ifndef MADV_HUGEPAGE
+    #define MADV_HUGEPAGE (14)
+#endif
+
+/* Configuration options */
+//TAGGED_REGION_HUGE_PAGE_SIZE: size of huge pages (hugetlb default page size, and THP size).
+//TAGGED_REGION_MAX_CPUS: largest number of CPUs (and NUMA nodes) supported when pinning threads.
+//TAGGED_REGION_MAX_THREADS: largest number of threads tagging a region.
+
+#ifndef TAGGED_REGION_HUGE_PAGE_SIZE
+    #define TAGGED_REGION_HUGE_PAGE_SIZE (2U << 20)
+#endif
+
+#ifndef TAGGED_REGION_MAX_CPUS
+    #define TAGGED_REGION_MAX_CPUS (1024U)
+#endif
+
+#ifndef TAGGED_REGION_MAX_THREADS
+    #define TAGGED_REGION_MAX_THREADS (64U)
+#endif
+
+#define TAGGED_REGION_ANY_NODE (-1)
+#define TAGGED_REGION_MASK_WORDS (TAGGED_REGION_MAX_CPUS / (8U * sizeof(unsigned long)))
+
+#define TAGGED_REGION_MPOL_BIND (2)
+
+static_assert((TAGGED_REGION_HUGE_PAGE_SIZE & (TAGGED_REGION_HUGE_PAGE_SIZE - 1)) == 0, "Huge page size must be a power of 2");
+
+//Flags of taggedRegionReserve
+#define TAGGED_REGION_NO_HUGETLB (1U << 0) //Never use hugetlb pages
+#define TAGGED_REGION_NO_THP     (1U << 1) //Never use transparent huge pages
+
+typedef enum TaggedRegionPages {
+    TAGGED_REGION_PAGES_SMALL,   //Regular pages
+    TAGGED_REGION_PAGES_THP,     //Transparent huge pages (madvise'd, the kernel may still use regular pages)
+    TAGGED_REGION_PAGES_HUGETLB, //hugetlb pages
+} TaggedRegionPages;
+
+typedef struct TaggedRegion {
+    char* base;             //Untagged base of the region
+    size_t size;            //Size of the region (multiple of the huge page size)
+    void* mapping;          //Base of the whole mapping, which may be larger than the region for THP alignment
+    size_t mappingSize;
+    int node;               //Node the region is bound to, or TAGGED_REGION_ANY_NODE
+    TaggedRegionPages pages;
+} TaggedRegion;
+
+//Read a sysfs CPU list ("0-3,8,10-11") into a bitmask, returns the number of CPUs
+MTELIBINTERNAL unsigned taggedRegionReadCpuList(const char* path, unsigned long mask[TAGGED_REGION_MASK_WORDS]) {
+    memset(mask, 0, TAGGED_REGION_MASK_WORDS * sizeof(unsigned long));
+    FILE* const f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    unsigned count = 0;
+    unsigned first, last;
+    while (fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < TAGGED_REGION_MAX_CPUS; cpu++) {
+            mask[cpu / (8U * sizeof(unsigned long))] |= 1UL << (cpu % (8U * sizeof(unsigned long)));
+            count++;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+/**
+ * @brief Reserve a PROT_MTE region, backed by huge pages where the kernel supports it
+ *
+ * @param region Region to initialize
+ * @param size Size of the region (rounded up to huge page size)
+ * @param node NUMA node the region's memory must be allocated on, or TAGGED_REGION_ANY_NODE
+ * @param flags Combination of TAGGED_REGION_NO_HUGETLB and TAGGED_REGION_NO_THP
+ * @return 0 on success, -1 on failure (errno is set by mmap or mbind)
+ * @note Memory isn't touched: call taggedRegionTag to fault it in from the node it is bound to.
+ */
+MTELIBEXPORT int taggedRegionReserve(TaggedRegion* region, size_t size, int node, unsigned flags) {
+    MTE_ASSERT((node == TAGGED_REGION_ANY_NODE || (node >= 0 && (unsigned)node < TAGGED_REGION_MAX_CPUS)), "Invalid NUMA node");
+    memset(region, 0, sizeof(*region));
+    size = (size + TAGGED_REGION_HUGE_PAGE_SIZE - 1) & ~(size_t)(TAGGED_REGION_HUGE_PAGE_SIZE - 1);
+
+    void* mapping = MAP_FAILED;
+    size_t mappingSize = size;
+    char* base = NULL;
+    TaggedRegionPages pages = TAGGED_REGION_PAGES_SMALL;
+
+    //hugetlb fails without reserved huge pages, or on kernels not supporting PROT_MTE for them.
+    if (!(flags & TAGGED_REGION_NO_HUGETLB)) {
+        mapping = mmap(NULL, size, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_NORESERVE, -1, 0);
+        base = (char*)mapping;
+        pages = TAGGED_REGION_PAGES_HUGETLB;
+    }
+
+    if (mapping == MAP_FAILED) {
+        //Over-reserve to align the region to a huge page boundary, which THP requires.
+        mappingSize = size + ((flags & TAGGED_REGION_NO_THP) ? 0 : TAGGED_REGION_HUGE_PAGE_SIZE);
+        mapping = mmap(NULL, mappingSize, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return -1;
+        }
+        const uintptr_t aligned = ((uintptr_t)mapping + TAGGED_REGION_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(TAGGED_REGION_HUGE_PAGE_SIZE - 1);
+        base = (flags & TAGGED_REGION_NO_THP) ? (char*)mapping : (char*)aligned;
+        pages = TAGGED_REGION_PAGES_SMALL;
+        if (!(flags & TAGGED_REGION_NO_THP) && madvise(base, size, MADV_HUGEPAGE) == 0) {
+            pages = TAGGED_REGION_PAGES_THP;
+        }
+    }
+
+    if (node != TAGGED_REGION_ANY_NODE) {
+        unsigned long nodes[TAGGED_REGION_MASK_WORDS] = {0};
+        nodes[node / (8U * sizeof(unsigned long))] = 1UL << (node % (8U * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, base, size, TAGGED_REGION_MPOL_BIND, nodes, TAGGED_REGION_MAX_CPUS + 1, 0) != 0) {
+            const int error = errno;
+            munmap(mapping, mappingSize);
+            errno = error;
+            return -1;
+        }
+    }
+
+    region->base = base;
+    region->size = size;
+    region->mapping = mapping;
+    region->mappingSize = mappingSize;
+    region->node = node;
+    region->pages = pages;
+    return 0;
+}
+
+/**
+ * @brief Unmap a region
+ *
+ * @param region Region to release
+ */
+MTELIBEXPORT void taggedRegionRelease(TaggedRegion* region) {
+    munmap(region->mapping, region->mappingSize);
+    memset(region, 0, sizeof(*region));
+}
+
+typedef struct TaggedRegionWorker {
+    pthread_t thread;
+    char* start;                //Tagged
+    size_t size;
+    const unsigned long* cpus;  //CPUs the worker is pinned to, or NULL
+} TaggedRegionWorker;
+
+MTELIBINTERNAL void* taggedRegionWorkerMain(void* arg) {
+    const TaggedRegionWorker* const worker = (const TaggedRegionWorker*)arg;
+    if (worker->cpus != NULL) {
+        //Best effort: tagging still happens if pinning fails, pages are bound to the node by mbind anyway.
+        syscall(SYS_sched_setaffinity, 0, TAGGED_REGION_MASK_WORDS * sizeof(unsigned long), worker->cpus);
+    }
+    memoryTag(worker->start, worker->size);
+    return NULL;
+}
+
+/**
+ * @brief Tag a whole region in parallel, from threads pinned to the region's node
+ *
+ * @param region Region to tag
+ * @param tag Tag to give to the region
+ * @param threads Number of threads to use, 0 to use one per CPU of the node (capped to TAGGED_REGION_MAX_THREADS)
+ * @return Tagged pointer to the base of the region
+ * @note The region is split on huge page boundaries. Work of threads that cannot be created is done by the calling thread.
+ */
+MTELIBEXPORT void* taggedRegionTag(TaggedRegion* region, uint64_t tag, unsigned threads) {
+    VERIFY_VALID_TAG(tag);
+    char* const tagged = (char*)pointerSetTag(region->base, tag);
+
+    unsigned long cpus[TAGGED_REGION_MASK_WORDS];
+    unsigned cpuCount = 0;
+    if (region->node != TAGGED_REGION_ANY_NODE) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", region->node);
+        cpuCount = taggedRegionReadCpuList(path, cpus);
+    }
+    if (threads == 0) {
+        threads = (cpuCount != 0) ? cpuCount : (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    const size_t hugePages = region->size / TAGGED_REGION_HUGE_PAGE_SIZE;
+    if (threads > TAGGED_REGION_MAX_THREADS) {
+        threads = TAGGED_REGION_MAX_THREADS;
+    }
+    if (threads > hugePages) {
+        threads = (unsigned)hugePages;
+    }
+    if (threads <= 1) {
+        memoryTag(tagged, region->size);
+        return tagged;
+    }
+
+    TaggedRegionWorker workers[TAGGED_REGION_MAX_THREADS];
+    const size_t pagesPerThread = hugePages / threads;
+    const size_t extraPages = hugePages % threads;
+    size_t offset = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        const size_t workerPages = pagesPerThread + ((i < extraPages) ? 1 : 0);
+        workers[i].start = tagged + offset;
+        workers[i].size = workerPages * TAGGED_REGION_HUGE_PAGE_SIZE;
+        workers[i].cpus = (cpuCount != 0) ? cpus : NULL;
+        offset += workers[i].size;
+    }
+
+    //The calling thread does the first part itself, unpinned as it may not run on the node.
+    int started[TAGGED_REGION_MAX_THREADS] = {0};
+    for (unsigned i = 1; i < threads; i++) {
+        started[i] = (pthread_create(&workers[i].thread, NULL, taggedRegionWorkerMain, &workers[i]) == 0);
+    }
+    memoryTag(workers[0].start, workers[0].size);
+    for (unsigned i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            memoryTag(workers[i].start, workers[i].size);
+        }
+    }
+    return tagged;
+}
+
+#endif //MTELIB_REGION_H
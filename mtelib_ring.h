@@ -0,0 +1,214 @@
+/**
+ * @file mtelib_ring.h
+ * @author CreepNT
+ * @brief Tagged ring buffer, retagging each slot every time it is reused
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note Messages are copied and tagged in a single pass when published, and consumed in place through tagged pointers.
+ *       A consumer still holding a pointer to a slot once it has been released and published again faults.
+ */
+
+#ifndef MTELIB_RING_H
+#define MTELIB_RING_H
+
+#include "mtelib.h"
+
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint8_t, uint32_t, uint64_t
+#include <string.h> //memcpy, memset
+
+#include <sys/mman.h>
+
+#ifndef PROT_MTE
+    #define PROT_MTE (0x20)
+#endif
+
+#define TAGGED_RING_CACHE_LINE (64U)
+
+typedef enum TaggedRingMode {
+    TAGGED_RING_SPSC, //Single producer, single consumer
+    TAGGED_RING_MPMC, //Multiple producers, multiple consumers
+} TaggedRingMode;
+
+//Sequence numbers follow Vyukov's bounded queue: a slot is free for position pos when its sequence is pos,
+//holds a message for position pos when its sequence is pos + 1.
+typedef struct TaggedRingSlot {
+    _Alignas(TAGGED_RING_CACHE_LINE) _Atomic uint64_t sequence;
+    uint32_t size;  //Size of the message held by the slot
+    uint8_t tag;    //Tag the slot's memory currently holds
+} TaggedRingSlot;
+
+typedef struct TaggedRing {
+    char* base;             //Untagged base of the PROT_MTE mapping holding the slots
+    size_t slotSize;        //Size of each slot (aligned to tag boundary)
+    uint64_t slotCount;     //Number of slots (power of 2)
+    ExcludeMask excluded;   //Tags never given to slots
+    TaggedRingMode mode;
+    TaggedRingSlot* slots;
+
+    _Alignas(TAGGED_RING_CACHE_LINE) _Atomic uint64_t enqueuePos;
+    _Alignas(TAGGED_RING_CACHE_LINE) _Atomic uint64_t dequeuePos;
+} TaggedRing;
+
+//Message handed out to a consumer; memory stays valid until taggedRingRelease is called.
+typedef struct TaggedRingMessage {
+    void* data;         //Tagged pointer to the message, NULL if the ring was empty
+    size_t size;
+    uint64_t position;
+} TaggedRingMessage;
+
+/**
+ * @brief Create a tagged ring buffer
+ *
+ * @param ring Ring to initialize
+ * @param slotCount Number of slots (must be a power of 2)
+ * @param slotSize Maximum size of a message (rounded up to tag boundary)
+ * @param excluded Tags that must never be given to slots
+ * @param mode TAGGED_RING_SPSC or TAGGED_RING_MPMC
+ * @return 0 on success, -1 on failure (errno is set by mmap)
+ */
+MTELIBEXPORT int taggedRingInit(TaggedRing* ring, uint64_t slotCount, size_t slotSize, ExcludeMask excluded, TaggedRingMode mode) {
+    MTE_ASSERT(slotCount != 0 && (slotCount & (slotCount - 1)) == 0, "Slot count must be a power of 2");
+    memset(ring, 0, sizeof(*ring));
+    slotSize = (slotSize + GRANULE_ALIGNMENT_MASK) & ~(size_t)GRANULE_ALIGNMENT_MASK;
+
+    void* slots = mmap(NULL, slotCount * sizeof(TaggedRingSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        return -1;
+    }
+
+    void* base = mmap(NULL, slotCount * slotSize, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        munmap(slots, slotCount * sizeof(TaggedRingSlot));
+        return -1;
+    }
+
+    ring->base = (char*)base;
+    ring->slotSize = slotSize;
+    ring->slotCount = slotCount;
+    ring->excluded = excluded;
+    ring->mode = mode;
+    ring->slots = (TaggedRingSlot*)slots;
+    for (uint64_t i = 0; i < slotCount; i++) {
+        atomic_init(&ring->slots[i].sequence, i);
+    }
+    atomic_init(&ring->enqueuePos, 0);
+    atomic_init(&ring->dequeuePos, 0);
+    return 0;
+}
+
+/**
+ * @brief Release the memory of a ring
+ *
+ * @param ring Ring to destroy
+ */
+MTELIBEXPORT void taggedRingDestroy(TaggedRing* ring) {
+    munmap(ring->base, ring->slotCount * ring->slotSize);
+    munmap(ring->slots, ring->slotCount * sizeof(TaggedRingSlot));
+    memset(ring, 0, sizeof(*ring));
+}
+
+//Claim a position in the ring, either for producing (sequenceOffset == 0) or consuming (sequenceOffset == 1).
+MTELIBINTERNAL int taggedRingClaim(TaggedRing* ring, _Atomic uint64_t* position, uint64_t sequenceOffset, uint64_t* claimed) {
+    uint64_t pos = atomic_load_explicit(position, memory_order_relaxed);
+    for (;;) {
+        TaggedRingSlot* const slot = &ring->slots[pos & (ring->slotCount - 1)];
+        const uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        const int64_t diff = (int64_t)(sequence - (pos + sequenceOffset));
+        if (diff < 0) {
+            return -1; //Full when producing, empty when consuming
+        }
+        if (diff > 0) {
+            pos = atomic_load_explicit(position, memory_order_relaxed);
+            continue;
+        }
+
+        if (ring->mode == TAGGED_RING_SPSC) {
+            atomic_store_explicit(position, pos + 1, memory_order_relaxed);
+            break;
+        }
+        if (atomic_compare_exchange_weak_explicit(position, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+    *claimed = pos;
+    return 0;
+}
+
+/**
+ * @brief Copy a message into the next free slot, retagging the slot in the same pass
+ *
+ * @param ring Ring to publish to
+ * @param data Message to publish
+ * @param size Size of the message (at most the ring's slot size)
+ * @return 0 on success, -1 if the ring is full
+ * @note The slot gets a tag different from the one it had during the previous lap.
+ */
+MTELIBEXPORT int taggedRingPublish(TaggedRing* ring, const void* data, size_t size) {
+    MTE_ASSERT(size <= ring->slotSize, "Message too large for ring slots");
+
+    uint64_t pos;
+    if (taggedRingClaim(ring, &ring->enqueuePos, 0, &pos) != 0) {
+        return -1;
+    }
+
+    TaggedRingSlot* const slot = &ring->slots[pos & (ring->slotCount - 1)];
+    char* const slotMemory = ring->base + (pos & (ring->slotCount - 1)) * ring->slotSize;
+    char* const tagged = (char*)pointerSetTagFromSource(slotMemory, excludeMaskAddTag(ring->excluded, slot->tag));
+
+    //Whole granules are copied straight from the message, the last partial granule goes through a bounce buffer
+    //so that the message isn't read out of bounds.
+    const size_t fullSize = size & ~(size_t)GRANULE_ALIGNMENT_MASK;
+    memoryTagAndCopy(tagged, data, fullSize);
+    size_t taggedSize = fullSize;
+    if (fullSize != size) {
+        _Alignas(GRANULE_SIZE) uint8_t lastGranule[GRANULE_SIZE] = {0};
+        memcpy(lastGranule, (const char*)data + fullSize, size - fullSize);
+        memoryTagAndCopy(tagged + fullSize, lastGranule, GRANULE_SIZE);
+        taggedSize += GRANULE_SIZE;
+    }
+    //The rest of the slot only needs its tag changed, for stale pointers into it to fault too.
+    memoryTag(tagged + taggedSize, ring->slotSize - taggedSize);
+
+    slot->size = (uint32_t)size;
+    slot->tag = (uint8_t)pointerGetTag(tagged);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Take the next message out of the ring, without copying it
+ *
+ * @param ring Ring to consume from
+ * @return Message, whose data is NULL if the ring is empty
+ * @note The message must be handed back with taggedRingRelease for its slot to be reused.
+ */
+MTELIBEXPORT TaggedRingMessage taggedRingConsume(TaggedRing* ring) {
+    TaggedRingMessage message = { NULL, 0, 0 };
+
+    uint64_t pos;
+    if (taggedRingClaim(ring, &ring->dequeuePos, 1, &pos) != 0) {
+        return message;
+    }
+
+    const TaggedRingSlot* const slot = &ring->slots[pos & (ring->slotCount - 1)];
+    message.data = pointerSetTag(ring->base + (pos & (ring->slotCount - 1)) * ring->slotSize, slot->tag);
+    message.size = slot->size;
+    message.position = pos;
+    return message;
+}
+
+/**
+ * @brief Hand a consumed message back to the ring
+ *
+ * @param ring Ring the message was consumed from
+ * @param message Message returned by taggedRingConsume
+ * @note message.data must not be used anymore: it faults once the slot is published again.
+ */
+MTELIBEXPORT void taggedRingRelease(TaggedRing* ring, const TaggedRingMessage* message) {
+    TaggedRingSlot* const slot = &ring->slots[message->position & (ring->slotCount - 1)];
+    atomic_store_explicit(&slot->sequence, message->position + ring->slotCount, memory_order_release);
+}
+
+#endif //MTELIB_RING_H
@@ -0,0 +1,341 @@
+/**
+ * @file mtelib_shared.h
+ * @author CreepNT
+ * @brief PROT_MTE shared memory regions backed by a memfd, for zero-copy hand-off between processes
+ *
+ * @copyright Copyright (c) CreepNT 2022
+ * @note The region is split in blocks, each owned in turn by a producer then by a consumer. Every time a producer
+ *       takes a block, the block's epoch is incremented and the block is retagged with a tag derived from it:
+ *       pointers from previous epochs fault, and consumers validate pointers by tag instead of copying data out.
+ */
+
+#ifndef MTELIB_SHARED_H
+#define MTELIB_SHARED_H
+
+#include "mtelib.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h> //size_t
+#include <stdint.h> //uint64_t, uintptr_t
+#include <string.h> //memset
+#include <unistd.h> //close, ftruncate, syscall, sysconf
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef PROT_MTE
+    #define PROT_MTE (0x20)
+#endif
+
+#ifndef MFD_CLOEXEC
+    #define MFD_CLOEXEC (0x0001U)
+#endif
+
+#define SHARED_REGION_MAGIC (0x4D54455348524547ULL) //"MTESHREG"
+
+//Block states, held in the lower bits of the block's state word, the epoch being held in the upper bits.
+#define SHARED_REGION_FREE       (0ULL) //Can be taken by a producer
+#define SHARED_REGION_WRITING    (1ULL) //Being written by a producer
+#define SHARED_REGION_PUBLISHED  (2ULL) //Can be acquired by a consumer
+#define SHARED_REGION_CONSUMING  (3ULL) //Being read by a consumer
+#define SHARED_REGION_STATE_MASK (3ULL)
+#define SHARED_REGION_EPOCH_SHIFT (2U)
+
+//Tag of a block during an epoch. Tag 0 is never used, so that the header and never written blocks never match.
+#define SHARED_REGION_EPOCH_TAG(epoch) (1ULL + ((epoch) % MAX_TAG))
+
+typedef struct SharedRegionBlock {
+    _Atomic uint64_t state; //Epoch << SHARED_REGION_EPOCH_SHIFT | state
+    uint64_t size;          //Size of the data published in the block
+} SharedRegionBlock;
+
+//Stored at the start of the region (with tag 0), so that processes opening it know its layout.
+typedef struct SharedRegionHeader {
+    uint64_t magic;
+    uint64_t blockSize;
+    uint64_t blockCount;
+    uint64_t dataOffset;    //Offset of the first block from the start of the region
+    SharedRegionBlock blocks[];
+} SharedRegionHeader;
+
+typedef struct SharedRegion {
+    int fd;
+    char* base;             //Untagged, also points to the header
+    size_t size;
+    SharedRegionHeader* header;
+    char* data;             //Untagged
+    size_t blockSize;       //Geometry of the region, copied out of the header once validated:
+    size_t blockCount;      //the header is shared, and may be modified by other processes at any time
+} SharedRegion;
+
+typedef struct SharedRegionView {
+    void* data;             //Tagged pointer to the block, NULL if it couldn't be acquired
+    size_t size;
+    uint64_t block;
+    uint64_t epoch;
+} SharedRegionView;
+
+MTELIBINTERNAL int sharedRegionMap(SharedRegion* region, int fd, size_t size) {
+    void* const base = mmap(NULL, size, PROT_MTE | PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    region->fd = fd;
+    region->base = (char*)base;
+    region->size = size;
+    region->header = (SharedRegionHeader*)base;
+    return 0;
+}
+
+//Compute the size of the header (blocks included) and of the whole region, returns 0 if they overflow.
+MTELIBINTERNAL int sharedRegionComputeSizes(size_t blockSize, size_t blockCount, size_t* blocksEnd, size_t* dataSize) {
+    size_t blocks;
+    return !__builtin_mul_overflow(blockCount, sizeof(SharedRegionBlock), &blocks)
+        && !__builtin_add_overflow(blocks, sizeof(SharedRegionHeader), blocksEnd)
+        && !__builtin_mul_overflow(blockSize, blockCount, dataSize);
+}
+
+/**
+ * @brief Create a shared region
+ *
+ * @param region Region to initialize
+ * @param name Name of the memfd (only used for debugging, see memfd_create)
+ * @param blockSize Size of each block (rounded up to tag boundary)
+ * @param blockCount Number of blocks
+ * @return 0 on success, -1 on failure (errno is set by memfd_create, ftruncate or mmap, or to EINVAL if blockSize is 0
+ *         or the region would be too large)
+ * @note region->fd can be sent to other processes (e.g. with SCM_RIGHTS), which then call sharedRegionOpen.
+ */
+MTELIBEXPORT int sharedRegionCreate(SharedRegion* region, const char* name, size_t blockSize, size_t blockCount) {
+    memset(region, 0, sizeof(*region));
+    region->fd = -1;
+    blockSize = (blockSize + GRANULE_ALIGNMENT_MASK) & ~(size_t)GRANULE_ALIGNMENT_MASK; //0 if blockSize was 0, or overflowed
+
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t blocksEnd, dataSize, headerSize, size;
+    if (blockSize == 0 || !sharedRegionComputeSizes(blockSize, blockCount, &blocksEnd, &dataSize)
+        || __builtin_add_overflow(blocksEnd, pageSize - 1, &headerSize)
+        || __builtin_add_overflow(headerSize & ~(pageSize - 1), dataSize, &size) || size > (size_t)INT64_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    headerSize &= ~(pageSize - 1);
+
+    const int fd = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0 || sharedRegionMap(region, fd, size) != 0) {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    //The memfd is zero'ed, so blocks start free in epoch 0.
+    region->header->magic = SHARED_REGION_MAGIC;
+    region->header->blockSize = blockSize;
+    region->header->blockCount = blockCount;
+    region->header->dataOffset = headerSize;
+    region->data = region->base + headerSize;
+    region->blockSize = blockSize;
+    region->blockCount = blockCount;
+    return 0;
+}
+
+/**
+ * @brief Map a shared region created by another process
+ *
+ * @param region Region to initialize
+ * @param fd File descriptor of the region's memfd (owned by the region afterwards)
+ * @return 0 on success, -1 on failure (errno is set by fstat or mmap, or to EINVAL if fd isn't a valid shared region)
+ * @note The header is written by another process, so its geometry is validated, then only the validated copy is used.
+ */
+MTELIBEXPORT int sharedRegionOpen(SharedRegion* region, int fd) {
+    memset(region, 0, sizeof(*region));
+    region->fd = -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(SharedRegionHeader)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sharedRegionMap(region, fd, (size_t)st.st_size) != 0) {
+        return -1;
+    }
+
+    SharedRegionHeader header;
+    memcpy(&header, region->header, sizeof(header));
+
+    size_t blocksEnd, dataSize;
+    if (header.magic != SHARED_REGION_MAGIC || header.blockSize == 0 || (header.blockSize & GRANULE_ALIGNMENT_MASK) != 0
+        || (header.dataOffset & GRANULE_ALIGNMENT_MASK) != 0
+        || !sharedRegionComputeSizes((size_t)header.blockSize, (size_t)header.blockCount, &blocksEnd, &dataSize)
+        || header.dataOffset < blocksEnd || header.dataOffset > region->size || dataSize > region->size - header.dataOffset) {
+        munmap(region->base, region->size);
+        memset(region, 0, sizeof(*region));
+        region->fd = -1;
+        errno = EINVAL;
+        return -1;
+    }
+    region->data = region->base + header.dataOffset;
+    region->blockSize = (size_t)header.blockSize;
+    region->blockCount = (size_t)header.blockCount;
+    return 0;
+}
+
+/**
+ * @brief Unmap a shared region, and close its memfd
+ *
+ * @param region Region to close
+ */
+MTELIBEXPORT void sharedRegionClose(SharedRegion* region) {
+    munmap(region->base, region->size);
+    close(region->fd);
+    memset(region, 0, sizeof(*region));
+    region->fd = -1;
+}
+
+MTELIBINTERNAL void* sharedRegionBlockPointer(const SharedRegion* region, uint64_t block, uint64_t epoch) {
+    return pointerSetTag(region->data + block * region->blockSize, SHARED_REGION_EPOCH_TAG(epoch));
+}
+
+/**
+ * @brief Take a free block, to write data into it
+ *
+ * @param region Region holding the block
+ * @param block Index of the block
+ * @return Tagged pointer to the block, or NULL if the block isn't free (errno is set to EBUSY)
+ * @note The block is retagged for a new epoch: pointers to the block from previous epochs fault.
+ */
+MTELIBEXPORT void* sharedRegionBeginWrite(SharedRegion* region, uint64_t block) {
+    MTE_ASSERT(block < region->blockCount, "Invalid block index");
+    _Atomic uint64_t* const state = &region->header->blocks[block].state;
+
+    uint64_t current = atomic_load_explicit(state, memory_order_relaxed);
+    uint64_t epoch;
+    do {
+        if ((current & SHARED_REGION_STATE_MASK) != SHARED_REGION_FREE) {
+            errno = EBUSY;
+            return NULL;
+        }
+        epoch = (current >> SHARED_REGION_EPOCH_SHIFT) + 1;
+    } while (!atomic_compare_exchange_weak_explicit(state, &current, (epoch << SHARED_REGION_EPOCH_SHIFT) | SHARED_REGION_WRITING,
+                                                    memory_order_acquire, memory_order_relaxed));
+
+    void* const ptr = sharedRegionBlockPointer(region, block, epoch);
+    memoryTag(ptr, region->blockSize);
+    return ptr;
+}
+
+/**
+ * @brief Hand a written block over to consumers
+ *
+ * @param region Region holding the block
+ * @param block Index of the block, taken with sharedRegionBeginWrite
+ * @param size Size of the data written to the block
+ */
+MTELIBEXPORT void sharedRegionPublish(SharedRegion* region, uint64_t block, size_t size) {
+    MTE_ASSERT(block < region->blockCount, "Invalid block index");
+    MTE_ASSERT(size <= region->blockSize, "Data larger than block");
+    SharedRegionBlock* const entry = &region->header->blocks[block];
+    const uint64_t current = atomic_load_explicit(&entry->state, memory_order_relaxed);
+    MTE_ASSERT((current & SHARED_REGION_STATE_MASK) == SHARED_REGION_WRITING, "Block isn't being written");
+
+    entry->size = size;
+    atomic_store_explicit(&entry->state, (current & ~SHARED_REGION_STATE_MASK) | SHARED_REGION_PUBLISHED, memory_order_release);
+}
+
+/**
+ * @brief Acquire a published block, to read its data in place
+ *
+ * @param region Region holding the block
+ * @param block Index of the block
+ * @return View of the block, whose data is NULL if the block isn't published (errno is set to EAGAIN)
+ */
+MTELIBEXPORT SharedRegionView sharedRegionAcquire(SharedRegion* region, uint64_t block) {
+    MTE_ASSERT(block < region->blockCount, "Invalid block index");
+    SharedRegionView view = { NULL, 0, block, 0 };
+    SharedRegionBlock* const entry = &region->header->blocks[block];
+
+    uint64_t current = atomic_load_explicit(&entry->state, memory_order_relaxed);
+    do {
+        if ((current & SHARED_REGION_STATE_MASK) != SHARED_REGION_PUBLISHED) {
+            errno = EAGAIN;
+            return view;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&entry->state, &current, (current & ~SHARED_REGION_STATE_MASK) | SHARED_REGION_CONSUMING,
+                                                    memory_order_acquire, memory_order_relaxed));
+
+    view.epoch = current >> SHARED_REGION_EPOCH_SHIFT;
+    view.data = sharedRegionBlockPointer(region, block, view.epoch);
+    view.size = entry->size;
+    if (view.size > region->blockSize) {
+        view.size = region->blockSize; //Written by the producer's process, must not go past the block
+    }
+    return view;
+}
+
+/**
+ * @brief Hand a block back to producers
+ *
+ * @param region Region holding the block
+ * @param view View returned by sharedRegionAcquire
+ * @note view->data must not be used anymore: it faults once a producer takes the block again.
+ */
+MTELIBEXPORT void sharedRegionRelease(SharedRegion* region, const SharedRegionView* view) {
+    atomic_store_explicit(&region->header->blocks[view->block].state,
+                          (view->epoch << SHARED_REGION_EPOCH_SHIFT) | SHARED_REGION_FREE, memory_order_release);
+}
+
+/**
+ * @brief Convert a pointer into the region into a handle other processes mapping the region understand
+ *
+ * @param region Region the pointer points into
+ * @param ptr Tagged pointer into the region
+ * @return Offset of ptr from the start of the region, with the tag of ptr in its top byte
+ */
+MTELIBEXPORT uint64_t sharedRegionHandle(const SharedRegion* region, const void* ptr) {
+    const uint64_t offset = (uint64_t)((char*)pointerSetTag((void*)ptr, 0) - region->base);
+    return offset | (pointerGetTag((void*)ptr) << TAG_SHIFT);
+}
+
+/**
+ * @brief Convert a handle received from another process into a pointer, checking it is still valid
+ *
+ * @param region Region the handle refers to
+ * @param handle Handle returned by sharedRegionHandle
+ * @param size Size of the data the handle refers to
+ * @return Tagged pointer, or NULL if the handle is out of the region, or its tag isn't the one of the block's
+ *         current epoch (the memory's allocation tag is checked too, using LDG)
+ */
+MTELIBEXPORT void* sharedRegionValidate(const SharedRegion* region, uint64_t handle, size_t size) {
+    const uint64_t tag = (handle >> TAG_SHIFT) & MAX_TAG;
+    const uint64_t offset = handle & ~(MAX_TAG << TAG_SHIFT);
+    const uint64_t dataOffset = (uint64_t)(region->data - region->base);
+    if (offset < dataOffset || size > region->blockSize) {
+        return NULL;
+    }
+
+    const uint64_t block = (offset - dataOffset) / region->blockSize;
+    if (block >= region->blockCount || (offset - dataOffset) % region->blockSize + size > region->blockSize) {
+        return NULL;
+    }
+
+    const uint64_t current = atomic_load_explicit(&region->header->blocks[block].state, memory_order_acquire);
+    const uint64_t state = current & SHARED_REGION_STATE_MASK;
+    if ((state != SHARED_REGION_PUBLISHED && state != SHARED_REGION_CONSUMING)
+        || SHARED_REGION_EPOCH_TAG(current >> SHARED_REGION_EPOCH_SHIFT) != tag) {
+        return NULL;
+    }
+
+    void* const ptr = pointerSetTag(region->base + offset, tag);
+    return (memoryGetTag(ptr) == tag) ? ptr : NULL;
+}
+
+#endif //MTELIB_SHARED_H
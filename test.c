@@ -1,5 +1,10 @@
 
 #include "mtelib.h"
+#include "mtelib_arena.h"
+#include "mtelib_fault.h"
+#include "mtelib_layout.h"
+#include "mtelib_mode.h"
+#include "mtelib_ring.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -16,6 +21,8 @@ void SIGSEGV_handler(int signal, siginfo_t* si, void* arg) {
 	if (si->si_code == SEGV_MTESERR) {
 		printf("si_code == SEGV_MTESERR (MTE Synchronous Error)\n");
 		printf("si_addr = %p\n", si->si_addr);
+		fflush(stdout);
+		mteFaultReport(si);
 	}
 	//Maybe we should munmap() here? Process will die anyways so I guess it doesn't matter much
 	exit(0);
@@ -27,21 +34,22 @@ int main(void) {
 	int curTagCtrl = prctl(PR_GET_TAGGED_ADDR_CTRL, 0, 0, 0, 0);
 	printf("prctl(PR_GET_TAGGED_ADDR_CTRL) -> %#x\n", curTagCtrl);
 
+	printf("Preferred mode of CPU 0: %d\n", mteModeGetPreferred(0));
+
 	//Enable MTE for syscalls + synchronous exception dispatching
-	int res = prctl(PR_SET_TAGGED_ADDR_CTRL,
-		PR_TAGGED_ADDR_ENABLE | PR_MTE_TCF_SYNC | ((0x7FF8 & ~(1 << MAX_TAG)) << 3), 0, 0, 0);
-	//shl by 3 to be in PR_MTE_TAG_MASK (this takes an INCLUDE mask so remove MAX_TAG - it is reserved)
+	//IRG never generates tags 0 to 2, nor MAX_TAG - it is reserved
+	int res = mteModeSet(MTE_MODE_SYNC, excludeMaskAddTag(0x7, MAX_TAG));
 
-	printf("prctl(PR_SET_TAGGED_ADDR_CTRL) -> %d\n", res);
+	printf("mteModeSet(MTE_MODE_SYNC) -> %d\n", res);
 	if (res < 0) {
-	        printf("Error %d: %s\n", res, strerror(res));
+	        printf("Error %d: %s\n", errno, strerror(errno));
 		return 1;
 	}
 
 	struct sigaction sa = {0};
 	sigemptyset(&sa.sa_mask);
 	sa.sa_sigaction = SIGSEGV_handler;
-	sa.sa_flags = SA_SIGINFO;
+	sa.sa_flags = SA_SIGINFO | SA_EXPOSE_TAGBITS;
 	res = sigaction(SIGSEGV, &sa, NULL);
 	printf("sigaction(SIGSEGV) -> %d\n", res);
 	if (res == -1) {
@@ -96,6 +104,28 @@ int main(void) {
 	memoryTagAndCopy(dst, ptr, 64);
 	printf("Data at %p: '%s'\n", dst, dst);
 
+	puts("\n== memoryGetTags test ==\n");
+	uint8_t tags[PACKED_TAGS_SIZE(128)];
+	memoryGetTags(mem, 128, tags);
+	printf("Tags of the first 8 granules (expecting 4x %ld then 4x %ld):", pointerGetTag(ptr), pointerGetTag(dst));
+	for (size_t i = 0; i < 8; i++) {
+		printf(" %ld", packedTagsGet(tags, i));
+	}
+	puts("");
+
+	puts("Swapping halves using memorySetTags...");
+	uint8_t swapped[PACKED_TAGS_SIZE(128)], readback[PACKED_TAGS_SIZE(128)];
+	memcpy(swapped, tags + 2, 2);
+	memcpy(swapped + 2, tags, 2);
+	memorySetTags(mem, 128, swapped);
+	memoryGetTags(mem, 128, readback);
+	printf("Tags of the first 8 granules are now:");
+	for (size_t i = 0; i < 8; i++) {
+		printf(" %ld", packedTagsGet(readback, i));
+	}
+	puts("");
+	memorySetTags(mem, 128, tags);
+
 	puts("\n== Exclude masks test ==\n");
 	uint64_t notAllowedTag = pointerGetTag(dst);
 	printf("Reusing our previously tagged pointer %p (tag %ld)\n", dst, notAllowedTag);
@@ -122,6 +152,131 @@ int main(void) {
 		printf("Never got tag %ld :D\n", notAllowedTag);
 	}
 
+	puts("\n== Batch random tags test ==\n");
+	void* slots[1000];
+	pointerSetRandomTags(slots, mem, GRANULE_SIZE, 1000, excludeMaskAddTag(0, MAX_TAG));
+	bool sameNeighbours = false;
+	for (int i = 1; i < 1000; i++) {
+		if (pointerGetTag(slots[i]) == pointerGetTag(slots[i - 1])) {
+			printf("!!! Slots %d and %d share tag %ld !!!\n", i - 1, i, pointerGetTag(slots[i]));
+			sameNeighbours = true;
+			break;
+		}
+	}
+	if (!sameNeighbours) {
+		puts("Neighbouring slots never share a tag :D");
+	}
+
+	puts("\n== Slab layout test ==\n");
+	//Own mapping: the first granule of slabs gets SLAB_LAYOUT_REDZONE_TAG (MAX_TAG), which mem must not have for the violations test.
+	void* slab = mmap(NULL, 0x1000, PROT_MTE | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+	SlabLayout layout;
+	uint8_t slotTags[0x1000 / GRANULE_SIZE / 2];
+	slabLayoutInit(&layout, 0x1000, 48, true, excludeMaskAddTag(0, 0));
+	slabLayoutTagSlab(&layout, slab, slotTags, true);
+	printf("%zu slots of %zu bytes with redzones, first one at %p, redzone tag %ld\n", layout.slotCount, layout.slotSize,
+		slabLayoutSlot(&layout, slab, slotTags, 0), memoryGetTag(slab));
+
+	slabLayoutInit(&layout, 0x1000, 48, false, excludeMaskAddTag(0, 0));
+	slabLayoutTagSlab(&layout, slab, slotTags, true);
+	slabLayoutRetagSlot(&layout, slab, slotTags, 1, true);
+	sameNeighbours = false;
+	for (size_t i = 1; i < layout.slotCount; i++) {
+		if (memoryGetTag(slabLayoutSlot(&layout, slab, slotTags, i)) == memoryGetTag(slabLayoutSlot(&layout, slab, slotTags, i - 1))) {
+			printf("!!! Slots %zu and %zu share tag %ld !!!\n", i - 1, i, packedTagsGet(slotTags, i));
+			sameNeighbours = true;
+			break;
+		}
+	}
+	if (!sameNeighbours) {
+		printf("%zu slots of %zu bytes without redzones, neighbours never share a tag :D (leading granule tag %ld)\n", layout.slotCount, layout.slotSize, memoryGetTag(slab));
+	}
+	munmap(slab, 0x1000);
+
+	puts("\n== Tagged arena test ==\n");
+	TaggedArena arena;
+	res = taggedArenaInit(&arena, 1 << 20, excludeMaskAddTag(0, MAX_TAG));
+	printf("taggedArenaInit() -> %d\n", res);
+	if (res < 0) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	uint64_t* chunkA = taggedArenaAlloc(&arena, 64);
+	uint64_t* chunkB = taggedArenaAlloc(&arena, 64);
+	printf("Allocated %p (tag %ld) and %p (tag %ld)\n", chunkA, pointerGetTag(chunkA), chunkB, pointerGetTag(chunkB));
+	*chunkA = 0x1234;
+	printf("*chunkA = %#lx\n", *chunkA);
+
+	taggedArenaFree(&arena, chunkA);
+	uint64_t* chunkC = taggedArenaAlloc(&arena, 64);
+	printf("Reallocated %p (tag %ld, was %ld), *chunkC = %#lx\n", chunkC, pointerGetTag(chunkC), pointerGetTag(chunkA), *chunkC);
+
+	uint64_t* buffer = taggedArenaAlloc(&arena, 256);
+	uint64_t* shrunk = taggedArenaRealloc(&arena, buffer, 256, 64);
+	uint64_t* grown = taggedArenaRealloc(&arena, shrunk, 64, 192);
+	printf("Realloc'ed %p (tag %ld) in place: %s, granule 176 has tag %ld, granule 208 has tag %ld\n", buffer, pointerGetTag(buffer),
+		(grown == buffer) ? "yes" : "no", memoryGetTag((char*)grown + 176), memoryGetTag((char*)grown + 208));
+	taggedArenaFree(&arena, grown);
+
+	const uint64_t header[3] = { 0x1111, 0x2222, 0x3333 };
+	uint64_t* object = taggedArenaAllocInit(&arena, 128, header, sizeof(header));
+	printf("Allocated initialized %p (tag %ld): %#lx %#lx %#lx %#lx\n", object, pointerGetTag(object), object[0], object[1], object[2], object[3]);
+	taggedArenaFree(&arena, object);
+
+	taggedArenaSetSampleRate(&arena, 4);
+	int sampled = 0;
+	for (int i = 0; i < 16; i++) {
+		void* chunk = taggedArenaAlloc(&arena, 32);
+		sampled += (pointerGetTag(chunk) != 0);
+		taggedArenaFree(&arena, chunk);
+	}
+	printf("Sampling 1 in 4: %d out of 16 allocations tagged\n", sampled);
+	taggedArenaDestroy(&arena);
+
+	puts("\n== Tagged ring test ==\n");
+	TaggedRing ring;
+	res = taggedRingInit(&ring, 4, 64, excludeMaskAddTag(0, MAX_TAG), TAGGED_RING_SPSC);
+	printf("taggedRingInit() -> %d\n", res);
+	if (res < 0) {
+		printf("Error %d: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	const char greeting[] = "Hello from the ring!";
+	uint8_t lastSlotTag = 0;
+	for (int lap = 0; lap < 3; lap++) {
+		for (int i = 0; i < 4; i++) {
+			taggedRingPublish(&ring, greeting, sizeof(greeting));
+			TaggedRingMessage message = taggedRingConsume(&ring);
+			if (i == 0) {
+				printf("Lap %d: slot 0 at %p (tag %ld), \"%s\"\n", lap, message.data, pointerGetTag(message.data), (const char*)message.data);
+				if (lap != 0 && pointerGetTag(message.data) == lastSlotTag) {
+					puts("Slot kept its tag across laps!");
+					return 1;
+				}
+				lastSlotTag = (uint8_t)pointerGetTag(message.data);
+			}
+			taggedRingRelease(&ring, &message);
+		}
+	}
+	printf("taggedRingConsume() on empty ring -> %p\n", taggedRingConsume(&ring).data);
+	taggedRingDestroy(&ring);
+
+	puts("\n== MTE mode scope test ==\n");
+	MTEMode mode;
+	MTEModeScope scope;
+	res = mteModeScopeEnter(&scope, MTE_MODE_ASYNC);
+	mteModeGet(&mode, NULL);
+	printf("mteModeScopeEnter(MTE_MODE_ASYNC) -> %d, mode is now %d\n", res, mode);
+	mteModeScopeExit(&scope);
+	mteModeGet(&mode, NULL);
+	printf("mteModeScopeExit() -> mode is back to %d\n", mode);
+
 	puts("\n== MTE violations test ==\n");
 	uint64_t* mteViolator = (uint64_t*)pointerSetTag(ptr, MAX_TAG);
 	puts("Using tag 15, excluded from random generation via prctl().");